@@ -0,0 +1,16 @@
+make
+if [ ! -e text8 ]; then
+  wget http://mattmahoney.net/dc/text8.zip -O text8.gz
+  gzip -d text8.gz -f
+fi
+# Measures how hierarchical softmax training scales with the number of threads, with the
+# Huffman tree shared by all threads and with private copies of its top 8 levels (-hs-private).
+MAX_THREADS=`nproc`
+echo "threads  shared  private (words/sec)"
+THREADS=1
+while [ $THREADS -le $MAX_THREADS ]; do
+  SHARED=`./word2vec -train text8 -output /dev/null -cbow 0 -size 200 -window 8 -negative 0 -hs 1 -sample 1e-4 -threads $THREADS -iter 1 -debug 1 | grep -o "Words/sec: [0-9.]*k" | tail -1 | cut -d ' ' -f 2`
+  PRIVATE=`./word2vec -train text8 -output /dev/null -cbow 0 -size 200 -window 8 -negative 0 -hs 1 -sample 1e-4 -threads $THREADS -iter 1 -debug 1 -hs-private 8 | grep -o "Words/sec: [0-9.]*k" | tail -1 | cut -d ' ' -f 2`
+  echo "$THREADS  $SHARED  $PRIVATE"
+  if [ $THREADS -lt $MAX_THREADS ] && [ $((THREADS * 2)) -gt $MAX_THREADS ]; then THREADS=$MAX_THREADS; else THREADS=$((THREADS * 2)); fi
+done
@@ -17,23 +17,62 @@
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define MAX_STRING 60
 
-const int vocab_hash_size = 500000000; // Maximum 500M entries in the vocabulary
+// The vocabulary is pruned (see ReduceVocab) whenever it grows beyond this.
+const long long vocab_size_limit = 350000000; // Maximum 350M entries in the vocabulary
 
 typedef float real;                    // Precision of float numbers
 
-struct vocab_word {
-  long long cn;
-  char *word;
+// The vocabulary, as parallel arrays: the counts, and where each word's
+// string starts in the 'vocab_strings' arena (see "Vocab Storage").
+struct string_arena {
+  char *data;
+  long long size, max_size;
 };
 
 char train_file[MAX_STRING], output_file[MAX_STRING];
-struct vocab_word *vocab;
-int debug_mode = 2, min_count = 5, *vocab_hash, min_reduce = 1;
+long long *vocab_cn, *vocab_str;
+struct string_arena vocab_strings;
+int debug_mode = 2, min_count = 5, min_reduce = 1, num_threads = 12;
 long long vocab_max_size = 10000, vocab_size = 0;
 
+/*
+ * ======== vocab_hash ========
+ * This is the hash table for the vocabulary. Word strings are hashed to a
+ * 64-bit hash code (see GetWordHash), and the low bits of the hash code pick
+ * the slot in 'vocab_hash' which holds the index of the word within the
+ * 'vocab' array. Collisions go to the next free slot (linear probing).
+ *
+ * Each slot also keeps the high 32 bits of the word's hash code as a
+ * "fingerprint". A lookup only reads the word's string when the fingerprint
+ * matches, so probing past other words almost never touches 'vocab'.
+ *
+ * 'vocab_hash_size' is a power of two. The table grows (doubling) to stay at
+ * most 70% full, and is sized to the vocabulary when it is rebuilt, so its
+ * size follows the vocabulary rather than a fixed maximum. At
+ * 'vocab_size_limit' entries it has the smallest power of two slots which
+ * holds them at that load.
+ */
+struct vocab_slot {
+  unsigned int fp; // High 32 bits of the word's hash code.
+  int index;       // Index of the word in 'vocab', or -1 for an empty slot.
+};
+
+struct vocab_slot *vocab_hash = NULL;
+long long vocab_hash_size = 0, vocab_hash_used = 0;
+
 // The total number of words in the training corpus, tallied in the 
 // "LearnVocabFromTrainFile" function.
 long long train_words = 0;
@@ -42,94 +81,591 @@ real threshold = 100;
 
 unsigned long long next_random = 1;
 
-/**
- * ======== ReadWord ========
- * Reads a single word from a file, assuming space + tab + EOL to be word 
- * boundaries.
+/*
+ * ======== Text Reader ========
+ * Tokenizer for the training text, which replaces the fgetc-based ReadWord.
+ *
+ * NOTE: This section is identical to the Text Reader in word2vec.c
  *
- * NOTE: This function is identical with ReadWord in word2vec.c
+ * Regular files are memory mapped as a whole. Anything that can't be mapped
+ * (e.g., a pipe) is read in blocks of READER_BLOCK_SIZE bytes instead.
+ * Compressed files are decompressed into blocks as they are read; see
+ * "Compressed Input" below.
  *
- * Parameters:
- *   word - A char array allocated to hold the maximum length string.
- *   fin  - The training file.
+ * Words are returned as spans (pointer + length) into the mapping or block,
+ * so most words are never copied. The delimiter scan uses SSE2 to test 16
+ * bytes at a time. A word is only assembled in 'text_reader.word' when it
+ * contains a '\r' or runs past the end of a block; that slow path is a
+ * straight port of ReadWord, so the token semantics are the same:
+ *   - Words are separated by space, tab and newline.
+ *   - '\r' is skipped wherever it appears.
+ *   - A newline is returned as the token </s>.
+ *   - Words are truncated to MAX_STRING - 2 characters.
+ *   - A final word which isn't followed by a delimiter is dropped.
  */
-void ReadWord(char *word, FILE *fin) {
+#define READER_BLOCK_SIZE (1 << 20)
+
+struct text_reader {
+  int fd;
+  char *data;            // The mapped file, or the current block.
+  long long len;         // Number of valid bytes in 'data'.
+  long long pos;         // Read position within 'data'.
+  long long offset;      // File offset of data[0].
+  int mapped, eof;
+  char word[MAX_STRING]; // Scratch space for the slow path.
   
-  // 'a' will be the index into 'word'.
-  int a = 0, ch;
+  // Compressed input. For gzip, 'z' is the inflate state, 'zin' holds the
+  // compressed data read so far, and 'zoffset' is the offset in the
+  // compressed file just past it. 'members' is the member index being
+  // recorded (see InflateBlock). For zstd, 'child' is the decompressor.
+  z_stream *z;
+  unsigned char *zin;
+  long long zoffset, num_members, max_members;
+  int zdone, zmembers, indexing;
+  struct gz_member *members;
+  pid_t child;
+};
+
+/*
+ * ======== Compressed Input ========
+ * Training data can be gzip or zstd compressed; the format is detected from
+ * the first bytes of the file. gzip is inflated with zlib as the file is
+ * read, and zstd is piped through the 'zstd' command, which runs alongside
+ * the tokenizer as a separate process. Either way, the offsets used by
+ * ReaderTell and SeekReader count bytes of the uncompressed text, so the
+ * rest of the code doesn't need to know the data was compressed.
+ *
+ * A gzip file can be several gzip "members" back to back, e.g. from bgzip
+ * or from cat-ing separately gzipped pieces of a corpus, and each member
+ * can be inflated without the ones before it. The first reader to go
+ * through the whole file publishes where each member starts as 'gz_index',
+ * and after that SeekReader can jump to any offset by inflating from the
+ * start of the member which holds it. Readers which start at different
+ * members decompress in parallel.
+ */
+#define READER_TEXT 0
+#define READER_GZIP 1
+#define READER_ZSTD 2
+#define READER_ZIN_SIZE (1 << 18)
+
+struct gz_member {
+  long long offset;  // Where the member starts in the compressed file.
+  long long uoffset; // Where its data starts in the uncompressed text.
+};
+
+struct gz_member *gz_index = NULL;
+long long gz_index_size = 0;
+
+// Returns the format of 'file' (READER_TEXT, READER_GZIP or READER_ZSTD).
+// Only regular files are checked, since peeking at a pipe would lose data.
+int ReaderFormat(char *file) {
+  unsigned char magic[4];
+  struct stat st;
+  int format = READER_TEXT, fd;
+  if ((stat(file, &st) != 0) || !S_ISREG(st.st_mode)) return READER_TEXT;
+  if ((fd = open(file, O_RDONLY)) < 0) return READER_TEXT;
+  if (pread(fd, magic, 4, 0) == 4) {
+    if ((magic[0] == 0x1f) && (magic[1] == 0x8b)) format = READER_GZIP;
+    if ((magic[0] == 0x28) && (magic[1] == 0xb5) && (magic[2] == 0x2f) && (magic[3] == 0xfd))
+      format = READER_ZSTD;
+  }
+  close(fd);
+  return format;
+}
+
+// Starts 'zstd -dc file' and returns the read end of its output, or -1.
+int OpenZstd(char *file, pid_t *child) {
+  int p[2];
+  static const char msg[] = "ERROR: could not run zstd to decompress the input\n";
+  if (pipe(p)) return -1;
+  fcntl(p[0], F_SETFD, FD_CLOEXEC);
+  fcntl(p[1], F_SETFD, FD_CLOEXEC);
+  *child = fork();
+  if (*child == 0) {
+    dup2(p[1], 1);
+    execlp("zstd", "zstd", "-dcq", "--", file, (char *)NULL);
+    write(2, msg, sizeof(msg) - 1);
+    _exit(1);
+  }
+  close(p[1]);
+  if (*child < 0) {
+    close(p[0]);
+    return -1;
+  }
+  return p[0];
+}
+
+// Records that a gzip member starts at 'offset' in the compressed file and
+// at 'uoffset' in the text.
+void AddMember(struct text_reader *r, long long offset, long long uoffset) {
+  if (r->num_members == r->max_members) {
+    r->max_members = r->max_members * 2 + 16;
+    r->members = (struct gz_member *)realloc(r->members, r->max_members * sizeof(struct gz_member));
+  }
+  r->members[r->num_members].offset = offset;
+  r->members[r->num_members].uoffset = uoffset;
+  r->num_members++;
+}
+
+/**
+ * ======== OpenReader ========
+ * Opens 'file' for tokenizing. Returns NULL if the file can't be opened.
+ */
+struct text_reader *OpenReader(char *file) {
+  struct text_reader *r;
+  struct stat st;
+  pid_t child = 0;
+  int format = ReaderFormat(file), fd;
+  if (format == READER_ZSTD) fd = OpenZstd(file, &child);
+  else fd = open(file, O_RDONLY);
+  if (fd < 0) return NULL;
+  r = (struct text_reader *)calloc(1, sizeof(struct text_reader));
+  r->fd = fd;
+  r->child = child;
+  if (format == READER_GZIP) {
+    r->z = (z_stream *)calloc(1, sizeof(z_stream));
+    r->zin = (unsigned char *)malloc(READER_ZIN_SIZE);
+    r->data = (char *)malloc(READER_BLOCK_SIZE);
+    if (inflateInit2(r->z, 16 + MAX_WBITS) != Z_OK) {
+      printf("ERROR: could not initialize zlib\n");
+      exit(1);
+    }
+    r->indexing = 1;
+    AddMember(r, 0, 0);
+    return r;
+  }
+  if ((format == READER_TEXT) && (fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+    r->data = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (r->data != MAP_FAILED) {
+      r->mapped = 1;
+      r->len = st.st_size;
+      madvise(r->data, r->len, MADV_SEQUENTIAL);
+      return r;
+    }
+  }
+  r->data = (char *)malloc(READER_BLOCK_SIZE);
+  return r;
+}
+
+void CloseReader(struct text_reader *r) {
+  if (r->mapped) munmap(r->data, r->len);
+  else free(r->data);
+  if (r->z != NULL) {
+    inflateEnd(r->z);
+    free(r->z);
+    free(r->zin);
+    free(r->members);
+  }
+  close(r->fd);
+  if (r->child > 0) waitpid(r->child, NULL, 0);
+  free(r);
+}
+
+/**
+ * ======== InflateBlock ========
+ * Inflates the next block of a gzip file into 'data'. Returns 0 at the end
+ * of the file.
+ *
+ * zlib stops at the end of each member, so the stream is reset there to go
+ * on with the next one. Like gzip, anything after the last member which
+ * isn't gzip data (e.g., zero padding) is ignored. While reading from the
+ * start of the file, the reader notes where each member starts, and once it
+ * reaches the end this becomes 'gz_index' (if there isn't one yet).
+ */
+int InflateBlock(struct text_reader *r) {
+  static int warned = 0;
+  z_stream *z = r->z;
+  long long n;
+  int ret;
+  z->next_out = (unsigned char *)r->data;
+  z->avail_out = READER_BLOCK_SIZE;
+  while ((z->avail_out > 0) && !r->zdone) {
+    if (z->avail_in == 0) {
+      n = read(r->fd, r->zin, READER_ZIN_SIZE);
+      if (n <= 0) {
+        if ((z->total_in > 0) && !warned) printf("WARNING: the gzip data ends in the middle of a member\n");
+        if (z->total_in > 0) warned = 1;
+        r->zdone = 1;
+        break;
+      }
+      r->zoffset += n;
+      z->next_in = r->zin;
+      z->avail_in = n;
+    }
+    ret = inflate(z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      r->zmembers++;
+      if (r->indexing)
+        AddMember(r, r->zoffset - z->avail_in, r->offset + READER_BLOCK_SIZE - z->avail_out);
+      inflateReset(z);
+    } else if (ret != Z_OK) {
+      if ((r->zmembers > 0) && (z->total_out == 0)) {
+        r->zdone = 1;
+        break;
+      }
+      printf("ERROR: corrupt gzip data (%s)\n", z->msg != NULL ? z->msg : "unexpected end");
+      exit(1);
+    }
+  }
   
-  // Read until the end of the word or the end of the file.
-  while (!feof(fin)) {
+  // At the end, drop the member that was started after the last one.
+  if (r->zdone && r->indexing) {
+    r->indexing = 0;
+    while ((r->num_members > 1) && (r->members[r->num_members - 1].uoffset >=
+                                     r->offset + READER_BLOCK_SIZE - z->avail_out)) r->num_members--;
+    if (gz_index == NULL) {
+      gz_index = r->members;
+      gz_index_size = r->num_members;
+      r->members = NULL;
+    }
+  }
+  r->len = READER_BLOCK_SIZE - z->avail_out;
+  return r->len > 0;
+}
+
+/**
+ * ======== ReaderFill ========
+ * Reads the next block once 'data' has been consumed. Returns 0 at the end
+ * of the file.
+ */
+int ReaderFill(struct text_reader *r) {
+  long long n;
+  if (r->mapped) return 0;
+  r->offset += r->len;
+  r->pos = 0;
+  r->len = 0;
+  if (r->z != NULL) return InflateBlock(r);
+  n = read(r->fd, r->data, READER_BLOCK_SIZE);
+  if (n <= 0) return 0;
+  r->len = n;
+  return 1;
+}
+
+/**
+ * ======== SeekReader ========
+ * Moves the read position to byte 'offset' of the file.
+ */
+void SeekReader(struct text_reader *r, long long offset) {
+  r->eof = 0;
+  if (r->mapped) {
+    r->pos = offset < r->len ? offset : r->len;
+    return;
+  }
   
-    // Get the next character.
-    ch = fgetc(fin);
+  // For gzip, inflate from the start of the member which holds 'offset'
+  // (the first member, without an index) and skip ahead to it.
+  if (r->z != NULL) {
+    long long lo = 0, hi = gz_index_size - 1, mid, start = 0, ustart = 0;
+    while (lo <= hi) {
+      mid = (lo + hi) / 2;
+      if (gz_index[mid].uoffset <= offset) {
+        start = gz_index[mid].offset;
+        ustart = gz_index[mid].uoffset;
+        lo = mid + 1;
+      } else hi = mid - 1;
+    }
+    lseek(r->fd, start, SEEK_SET);
+    inflateReset(r->z);
+    r->z->avail_in = 0;
+    r->zoffset = start;
+    r->zdone = 0;
+    r->indexing = 0;
+    r->offset = ustart;
+    r->pos = 0;
+    r->len = 0;
+    while ((r->offset + r->len <= offset) && ReaderFill(r));
+    r->pos = offset - r->offset < r->len ? offset - r->offset : r->len;
+    return;
+  }
+  lseek(r->fd, offset, SEEK_SET);
+  r->offset = offset;
+  r->pos = 0;
+  r->len = 0;
+}
 
-    // ASCII Character 13 is a carriage return 'CR' whereas character 10 is 
-    // newline or line feed 'LF'.    
-    if (ch == 13) continue;
+// Returns the file offset of the next unread byte.
+long long ReaderTell(struct text_reader *r) {
+  return r->offset + r->pos;
+}
+
+static inline int ReaderGetc(struct text_reader *r) {
+  if ((r->pos >= r->len) && !ReaderFill(r)) return EOF;
+  return (unsigned char)r->data[r->pos++];
+}
+
+/**
+ * ======== ScanDelimiter ========
+ * Returns a pointer to the first space, tab, newline or '\r' in [p, end), or
+ * 'end' if there is none.
+ */
+static inline char *ScanDelimiter(char *p, char *end) {
+#if defined(__SSE2__)
+  const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+  const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+  __m128i v;
+  int mask;
+  while (p + 16 <= end) {
+    v = _mm_loadu_si128((const __m128i *)p);
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+                                          _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr))));
+    if (mask) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  while ((p < end) && (*p != ' ') && (*p != '\t') && (*p != '\n') && (*p != '\r')) p++;
+  return p;
+}
 
-    // Check for word boundaries...    
+/**
+ * ======== ReadWordSlow ========
+ * ReadWord on top of ReaderGetc, for words that the fast path in
+ * ReadWordSpan can't return in place.
+ */
+int ReadWordSlow(struct text_reader *r, char **word, int *len) {
+  int a = 0, ch;
+  while (1) {
+    ch = ReaderGetc(r);
+    if (ch == EOF) {
+      r->eof = 1;
+      return 0;
+    }
+    if (ch == 13) continue;
     if ((ch == ' ') || (ch == '\t') || (ch == '\n')) {
-      // If the word has at least one character, we're done.
       if (a > 0) {
-        // Put the newline back so that we read it next time.
-        if (ch == '\n') ungetc(ch, fin);
+        // "Put back" the newline so that it's returned as </s> next time.
+        if (ch == '\n') r->pos--;
         break;
       }
-      // If the word is empty and the character is newline, treat this as the
-      // end of a "sentence" and mark it with the token </s>.      
       if (ch == '\n') {
-        strcpy(word, (char *)"</s>");
-        return;
-      // If the word is empty and the character is tab or space, just continue
-      // on to the next character.             
+        *word = (char *)"</s>";
+        *len = 4;
+        return 1;
       } else continue;
     }
-
-    // If the character wasn't space, tab, CR, or newline, add it to the word.    
-    word[a] = ch;
+    r->word[a] = ch;
     a++;
-    
-    // If the word's too long, truncate it, but keep going till we find the end
-    // of it.    
     if (a >= MAX_STRING - 1) a--;
   }
+  r->word[a] = 0;
+  *word = r->word;
+  *len = a;
+  return 1;
+}
+
+/**
+ * ======== ReadWordSpan ========
+ * Reads the next word. On success, '*word' points at its characters and
+ * '*len' is its length; the word is NOT null-terminated. Returns 0 at the
+ * end of the file, and sets 'r->eof'.
+ */
+int ReadWordSpan(struct text_reader *r, char **word, int *len) {
+  char *p, *q, *end;
+  int ch;
   
-  // Terminate the string with null.
-  word[a] = 0;
+  // Skip the spaces, tabs and CRs in front of the word.
+  while (1) {
+    if ((r->pos >= r->len) && !ReaderFill(r)) {
+      r->eof = 1;
+      return 0;
+    }
+    ch = r->data[r->pos];
+    if ((ch != ' ') && (ch != '\t') && (ch != '\r')) break;
+    r->pos++;
+  }
+  if (ch == '\n') {
+    r->pos++;
+    *word = (char *)"</s>";
+    *len = 4;
+    return 1;
+  }
+  
+  p = r->data + r->pos;
+  end = r->data + r->len;
+  q = ScanDelimiter(p, end);
+  
+  // Fast path: the word ends inside 'data' on a real delimiter.
+  if ((q < end) && (*q != '\r')) {
+    *word = p;
+    *len = q - p;
+    if (*len > MAX_STRING - 2) *len = MAX_STRING - 2;
+    // Leave a newline in place so that it's returned as </s> next time.
+    r->pos = (q - r->data) + (*q != '\n');
+    return 1;
+  }
+  
+  // At the end of a mapped file, a word without a delimiter is dropped.
+  if ((q == end) && r->mapped) {
+    r->pos = r->len;
+    r->eof = 1;
+    return 0;
+  }
+  return ReadWordSlow(r, word, len);
+}
+
+/**
+ * ======== ReadWordCopy ========
+ * Reads the next word into the null-terminated string 'word'. Returns 0 at
+ * the end of the file.
+ */
+int ReadWordCopy(char *word, struct text_reader *r) {
+  char *span;
+  int len;
+  if (!ReadWordSpan(r, &span, &len)) return 0;
+  memcpy(word, span, len);
+  word[len] = 0;
+  return 1;
 }
 
 /**
  * ======== GetWordHash ========
- * Returns hash value of a word. The hash is an integer between 0 and 
- * vocab_hash_size (default is 30E6).
+ * Returns the 64-bit hash of a word. The low bits pick the word's slot in
+ * 'vocab_hash', and the high 32 bits are its fingerprint.
+ *
+ * The word is mixed in 8 bytes at a time, MurmurHash3 style, followed by a
+ * final avalanche step. The original hash (hash * 257 + c, for each
+ * character c) was taken modulo a table size of 30M; a power-of-two table
+ * only looks at the low bits, so those have to depend on every character.
  *
- * For example, the word 'hat':
- * hash = ((((h * 257) + a) * 257) + t) % 30E6
+ * NOTE: This function and the three below are identical to the ones in
+ *       word2vec.c.
  */
-int GetWordHash(char *word) {
-  unsigned long long a, hash = 1;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % vocab_hash_size;
+unsigned long long GetWordHashSpan(char *word, int len) {
+  unsigned long long hash = 0x9E3779B97F4A7C15ULL ^ len, k;
+  int a, b;
+  for (a = 0; a < len; a += 8) {
+    if (len - a >= 8) memcpy(&k, word + a, 8);
+    else for (k = 0, b = len - 1; b >= a; b--) k = (k << 8) | (unsigned char)word[b];
+    k *= 0x87C37B91114253D5ULL;
+    k = (k << 31) | (k >> 33);
+    k *= 0x4CF5AD432745937FULL;
+    hash ^= k;
+    hash = ((hash << 27) | (hash >> 37)) * 5 + 0x52DCE729;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ULL;
+  hash ^= hash >> 33;
   return hash;
 }
 
+unsigned long long GetWordHash(char *word) {
+  return GetWordHashSpan(word, strlen(word));
+}
+
+/*
+ * ======== Vocab Storage ========
+ * NOTE: These functions are identical to the ones in word2vec.c.
+ */
+long long ArenaAdd(struct string_arena *a, char *word, int len) {
+  long long offset = a->size;
+  if (a->size + len + 1 > a->max_size) {
+    a->max_size = (a->size + len + 1) * 2;
+    a->data = (char *)realloc(a->data, a->max_size);
+    if (a->data == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+  }
+  memcpy(a->data + offset, word, len);
+  a->data[offset + len] = 0;
+  a->size += len + 1;
+  return offset;
+}
+
+static inline char *VocabWord(long long i) {
+  return vocab_strings.data + vocab_str[i];
+}
+
+void ReserveVocab(long long size) {
+  if (size <= vocab_max_size) return;
+  while (vocab_max_size < size) vocab_max_size *= 2;
+  vocab_cn = (long long *)realloc(vocab_cn, vocab_max_size * sizeof(long long));
+  vocab_str = (long long *)realloc(vocab_str, vocab_max_size * sizeof(long long));
+  if ((vocab_cn == NULL) || (vocab_str == NULL)) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+}
+
+void CompactVocabStrings() {
+  struct string_arena packed = {NULL, 0, 0};
+  long long a;
+  for (a = 0; a < vocab_size; a++) packed.max_size += strlen(VocabWord(a)) + 1;
+  packed.data = (char *)malloc(packed.max_size + 1);
+  if (packed.data == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < vocab_size; a++) vocab_str[a] = ArenaAdd(&packed, VocabWord(a), strlen(VocabWord(a)));
+  free(vocab_strings.data);
+  vocab_strings = packed;
+}
+
+/**
+ * ======== InitVocabHash ========
+ * Empties 'vocab_hash' and sizes it for 'words' words: the smallest power of
+ * two, and at least 1024, that keeps it no more than 70% full.
+ */
+void InitVocabHash(long long words) {
+  long long a, size = 1024;
+  while (size * 7 < words * 10) size *= 2;
+  if (size != vocab_hash_size) {
+    free(vocab_hash);
+    vocab_hash = (struct vocab_slot *)malloc(size * sizeof(struct vocab_slot));
+    if (vocab_hash == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+    vocab_hash_size = size;
+  }
+  for (a = 0; a < size; a++) vocab_hash[a].index = -1;
+  vocab_hash_used = 0;
+}
+
+// Stores word 'index' of 'vocab' in the first free slot from its hash.
+void InsertVocabHash(int index) {
+  unsigned long long hash = GetWordHash(VocabWord(index));
+  long long pos = hash & (vocab_hash_size - 1);
+  while (vocab_hash[pos].index != -1) pos = (pos + 1) & (vocab_hash_size - 1);
+  vocab_hash[pos].fp = hash >> 32;
+  vocab_hash[pos].index = index;
+  vocab_hash_used++;
+}
+
+// Adds word 'index' of 'vocab' to the hash table, after doubling the table
+// if it is 70% full.
+void AddToVocabHash(int index) {
+  struct vocab_slot *old = vocab_hash;
+  long long a, old_size = vocab_hash_size;
+  if ((vocab_hash_used + 1) * 10 > vocab_hash_size * 7) {
+    vocab_hash = NULL;
+    vocab_hash_size = 0;
+    InitVocabHash(old_size);
+    for (a = 0; a < old_size; a++) if (old[a].index != -1) InsertVocabHash(old[a].index);
+    free(old);
+  }
+  InsertVocabHash(index);
+}
+
 // Returns position of a word in the vocabulary; if the word is not found, returns -1
 int SearchVocab(char *word) {
-  unsigned int hash = GetWordHash(word);
+  unsigned long long hash = GetWordHash(word);
+  unsigned int fp = hash >> 32;
+  long long pos = hash & (vocab_hash_size - 1);
   while (1) {
-    if (vocab_hash[hash] == -1) return -1;
-    if (!strcmp(word, vocab[vocab_hash[hash]].word)) return vocab_hash[hash];
-    hash = (hash + 1) % vocab_hash_size;
+    if (vocab_hash[pos].index == -1) return -1;
+    if ((vocab_hash[pos].fp == fp) && !strcmp(word, VocabWord(vocab_hash[pos].index)))
+      return vocab_hash[pos].index;
+    pos = (pos + 1) & (vocab_hash_size - 1);
   }
   return -1;
 }
 
 // Reads a word and returns its index in the vocabulary
-int ReadWordIndex(FILE *fin) {
+int ReadWordIndex(struct text_reader *r) {
   char word[MAX_STRING];
-  ReadWord(word, fin);
-  if (feof(fin)) return -1;
+  if (!ReadWordCopy(word, r)) return -1;
   return SearchVocab(word);
 }
 
@@ -139,47 +675,145 @@ int ReadWordIndex(FILE *fin) {
  */
 int AddWordToVocab(char *word) {
   // Measure word length.
-  unsigned int hash, length = strlen(word) + 1;
+  unsigned int length = strlen(word);
   
   // Limit string length (default limit is 100 characters).
-  if (length > MAX_STRING) length = MAX_STRING;
+  if (length > MAX_STRING - 1) length = MAX_STRING - 1;
   
-  // Allocate and store the word string.
-  vocab[vocab_size].word = (char *)calloc(length, sizeof(char));
-  strcpy(vocab[vocab_size].word, word);
+  // Store the word string in the arena.
+  vocab_str[vocab_size] = ArenaAdd(&vocab_strings, word, length);
   
   // Initialize the word frequency to 0.
-  vocab[vocab_size].cn = 0;
+  vocab_cn[vocab_size] = 0;
   
   // Increment the vocabulary size.  
   vocab_size++;
   
-  // Reallocate memory if needed
-  if (vocab_size + 2 >= vocab_max_size) {
-    vocab_max_size += 10000;
-    vocab=(struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
-  }
+  // Grow the vocab arrays if needed.
+  ReserveVocab(vocab_size + 2);
 
   // Add the word to the 'vocab_hash' table so that we can map quickly from the
-  // string to its vocab_word structure. 
-  
-  // Hash the word to an integer between 0 and 30E6.  
-  hash = GetWordHash(word);
-  
-  // If the spot is already taken in the hash table, find the next empty spot.
-  while (vocab_hash[hash] != -1) 
-    hash = (hash + 1) % vocab_hash_size;
-    
-  // Map the hash code to the index of the word in the 'vocab' array.    
-  vocab_hash[hash]=vocab_size - 1;
+  // string to its vocab index. If the word's slot is already taken
+  // in the hash table, it goes in the next empty one.
+  AddToVocabHash(vocab_size - 1);
   
   // Return the index of the word in the 'vocab' array.
   return vocab_size - 1;
 }
 
-// Used later for sorting by word counts
-int VocabCompare(const void *a, const void *b) {
-    return ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
+/*
+ * ======== Parallel Vocab Sort ========
+ * NOTE: This section is identical to the one in word2vec.c.
+ */
+struct vocab_key {
+  long long cn, id;
+};
+
+struct radix_sort {
+  struct vocab_key *src, *dst;
+  long long size;
+  int shift, threads;
+  long long (*offsets)[256];  // offsets[thread][digit]
+  unsigned long long *diff;   // Bits that vary within each thread's block.
+};
+struct radix_sort radix;
+
+// The count as a sort key: larger counts get smaller keys, so that sorting
+// the keys in ascending order sorts the counts in descending order.
+static inline unsigned long long RadixKey(long long cn) {
+  return ~((unsigned long long)cn ^ 0x8000000000000000ULL);
+}
+
+// Gets the range of keys [start, end) in thread 'id's block.
+static inline void RadixBlock(long long id, long long *start, long long *end) {
+  *start = radix.size * id / radix.threads;
+  *end = radix.size * (id + 1) / radix.threads;
+}
+
+// Finds which bits of the keys differ within the thread's block.
+void *RadixDiffThread(void *id) {
+  long long a, start, end;
+  unsigned long long first, diff = 0;
+  RadixBlock((long long)id, &start, &end);
+  first = RadixKey(radix.src[start].cn);
+  for (a = start; a < end; a++) diff |= RadixKey(radix.src[a].cn) ^ first;
+  radix.diff[(long long)id] = diff | (first ^ RadixKey(radix.src[0].cn));
+  return NULL;
+}
+
+// Counts the digits of the current pass in the thread's block.
+void *RadixCountThread(void *id) {
+  long long a, start, end, *count = radix.offsets[(long long)id];
+  RadixBlock((long long)id, &start, &end);
+  memset(count, 0, 256 * sizeof(long long));
+  for (a = start; a < end; a++) count[(RadixKey(radix.src[a].cn) >> radix.shift) & 0xFF]++;
+  return NULL;
+}
+
+// Moves the thread's block to its place in 'dst'.
+void *RadixScatterThread(void *id) {
+  long long a, start, end, *offset = radix.offsets[(long long)id];
+  RadixBlock((long long)id, &start, &end);
+  for (a = start; a < end; a++)
+    radix.dst[offset[(RadixKey(radix.src[a].cn) >> radix.shift) & 0xFF]++] = radix.src[a];
+  return NULL;
+}
+
+/**
+ * ======== RadixSortKeys ========
+ * Sorts the 'size' keys in 'keys' by descending count, using 'tmp' (of the
+ * same size) as scratch space. Returns whichever of the two arrays holds the
+ * sorted keys.
+ */
+struct vocab_key *RadixSortKeys(struct vocab_key *keys, struct vocab_key *tmp, long long size) {
+  pthread_t *pt;
+  struct vocab_key *swap;
+  unsigned long long diff = 0;
+  long long a, b, pos;
+  
+  if (size < 2) return keys;
+  
+  // Only use as many threads as there are 64K keys to sort.
+  radix.threads = num_threads;
+  if (radix.threads > size / 65536) radix.threads = size / 65536;
+  if (radix.threads < 1) radix.threads = 1;
+  radix.size = size;
+  radix.src = keys;
+  radix.dst = tmp;
+  pt = (pthread_t *)malloc(radix.threads * sizeof(pthread_t));
+  radix.offsets = (long long (*)[256])malloc(radix.threads * sizeof(*radix.offsets));
+  radix.diff = (unsigned long long *)malloc(radix.threads * sizeof(unsigned long long));
+  
+  for (a = 0; a < radix.threads; a++) pthread_create(&pt[a], NULL, RadixDiffThread, (void *)a);
+  for (a = 0; a < radix.threads; a++) pthread_join(pt[a], NULL);
+  for (a = 0; a < radix.threads; a++) diff |= radix.diff[a];
+  
+  for (radix.shift = 0; radix.shift < 64; radix.shift += 8) {
+    // Skip the digits which are the same for every key.
+    if (((diff >> radix.shift) & 0xFF) == 0) continue;
+    
+    for (a = 0; a < radix.threads; a++) pthread_create(&pt[a], NULL, RadixCountThread, (void *)a);
+    for (a = 0; a < radix.threads; a++) pthread_join(pt[a], NULL);
+    
+    // Turn the counts into where each thread puts its first key with each
+    // digit.
+    pos = 0;
+    for (b = 0; b < 256; b++) for (a = 0; a < radix.threads; a++) {
+      long long count = radix.offsets[a][b];
+      radix.offsets[a][b] = pos;
+      pos += count;
+    }
+    
+    for (a = 0; a < radix.threads; a++) pthread_create(&pt[a], NULL, RadixScatterThread, (void *)a);
+    for (a = 0; a < radix.threads; a++) pthread_join(pt[a], NULL);
+    swap = radix.src;
+    radix.src = radix.dst;
+    radix.dst = swap;
+  }
+  free(pt);
+  free(radix.offsets);
+  free(radix.diff);
+  return radix.src;
 }
 
 /**
@@ -193,8 +827,9 @@ int VocabCompare(const void *a, const void *b) {
  * Removing words from the vocabulary requires recomputing the hash table.
  */
 void SortVocab() {
-  int a;
-  unsigned int hash;
+  long long a, size;
+  long long *sorted_cn, *sorted_str;
+  struct vocab_key *keys, *tmp, *sorted;
   
   /*
    * Sort the vocabulary by number of occurrences, in descending order. 
@@ -204,76 +839,280 @@ void SortVocab() {
    * Sorting the vocabulary this way causes the words with the fewest 
    * occurrences to be at the end of the vocabulary table. This will allow us
    * to free the memory associated with the words that get filtered out.
+   *
+   * Only the (count, index) pairs are sorted (see "Parallel Vocab Sort");
+   * the vocab arrays are then put in the sorted order.
    */
-  qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
+  keys = (struct vocab_key *)malloc(vocab_size * sizeof(struct vocab_key));
+  tmp = (struct vocab_key *)malloc(vocab_size * sizeof(struct vocab_key));
+  sorted_cn = (long long *)malloc(vocab_max_size * sizeof(long long));
+  sorted_str = (long long *)malloc(vocab_max_size * sizeof(long long));
+  if ((keys == NULL) || (tmp == NULL) || (sorted_cn == NULL) || (sorted_str == NULL)) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < vocab_size; a++) {
+    keys[a].cn = vocab_cn[a];
+    keys[a].id = a;
+  }
+  if (vocab_size > 1) sorted = RadixSortKeys(&keys[1], &tmp[1], vocab_size - 1);
+  else sorted = &keys[1];
+  sorted_cn[0] = vocab_cn[0];
+  sorted_str[0] = vocab_str[0];
+  for (a = 1; a < vocab_size; a++) {
+    sorted_cn[a] = vocab_cn[sorted[a - 1].id];
+    sorted_str[a] = vocab_str[sorted[a - 1].id];
+  }
+  free(keys);
+  free(tmp);
+  free(vocab_cn);
+  free(vocab_str);
+  vocab_cn = sorted_cn;
+  vocab_str = sorted_str;
   
-  // Clear the vocabulary hash table.
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  // Store the initial vocab size to use in the for loop condition.
+  size = vocab_size;
   
-  // For every word currently in the vocab...
-  for (a = 0; a < vocab_size; a++) {
+  // For every word currently in the vocab (except </s>, which stays at
+  // position 0)...
+  for (a = 0; a < size; a++) {
     
-    // Words occuring less than min_count times will be discarded from the vocab
-    if (vocab[a].cn < min_count) {
+    // Words occuring less than min_count times will be discarded from the
+    // vocab. They are all at the end, after the sort.
+    if ((vocab_cn[a] < min_count) && (a != 0)) {
       // Decrease the size of the new vocabulary.
       vocab_size--;
-      
-      // Free the memory associated with the word string.
-      free(vocab[vocab_size].word);
-    } else {
-      // Hash will be re-computed, as after the sorting it is not actual
-      hash = GetWordHash(vocab[a].word);
-      while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-      vocab_hash[hash] = a;
     }
   }
+  
+  // Free the memory associated with the dropped words' strings.
+  CompactVocabStrings();
+  
+  // Rebuild the hash table for the remaining words, as after the sorting it
+  // is not actual.
+  InitVocabHash(vocab_size);
+  for (a = 0; a < vocab_size; a++) InsertVocabHash(a);
 
-  // Reallocate the vocab array, chopping off all of the low-frequency words at
-  // the end of the table.  
-  vocab = (struct vocab_word *)realloc(vocab, vocab_size * sizeof(struct vocab_word));
+  // Reallocate the vocab arrays, chopping off all of the low-frequency words
+  // at the end of the table.
+  vocab_max_size = vocab_size + 1;
+  vocab_cn = (long long *)realloc(vocab_cn, vocab_max_size * sizeof(long long));
+  vocab_str = (long long *)realloc(vocab_str, vocab_max_size * sizeof(long long));
 }
 
 // Reduces the vocabulary by removing infrequent tokens
 void ReduceVocab() {
   int a, b = 0;
-  unsigned int hash;
-  for (a = 0; a < vocab_size; a++) if (vocab[a].cn > min_reduce) {
-    vocab[b].cn = vocab[a].cn;
-    vocab[b].word = vocab[a].word;
+  for (a = 0; a < vocab_size; a++) if (vocab_cn[a] > min_reduce) {
+    vocab_cn[b] = vocab_cn[a];
+    vocab_str[b] = vocab_str[a];
     b++;
-  } else free(vocab[a].word);
-  vocab_size = b;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  for (a = 0; a < vocab_size; a++) {
-    // Hash will be re-computed, as it is not actual
-    hash = GetWordHash(vocab[a].word);
-    while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-    vocab_hash[hash] = a;
   }
+  vocab_size = b;
+  CompactVocabStrings();
+  // Hash will be re-computed, as it is not actual
+  InitVocabHash(vocab_size);
+  for (a = 0; a < vocab_size; a++) InsertVocabHash(a);
   fflush(stdout);
   min_reduce++;
 }
 
+/*
+ * ======== External Vocab Counting ========
+ * NOTE: This section is identical to the one in word2vec.c, where it is
+ *       described; here it counts the unigrams and bigrams together.
+ */
+#define SPILL_MAX_RUNS 64
+
+struct spill_run {
+  FILE *f;
+  long long cn;
+  char word[MAX_STRING];
+};
+
+long long vocab_memory = 0;
+char spill_dir[MAX_STRING];
+struct spill_run spill_runs[SPILL_MAX_RUNS];
+int num_spill_runs = 0;
+
+// The memory taken by the words counted so far.
+long long VocabMemory() {
+  return vocab_size * 2 * sizeof(long long) + vocab_strings.size + vocab_hash_size * sizeof(struct vocab_slot);
+}
+
+// Creates an (already unlinked) temporary file in 'spill_dir'.
+FILE *CreateSpillFile() {
+  char path[MAX_STRING + 32];
+  FILE *f;
+  int fd;
+  snprintf(path, sizeof(path), "%s/vocab-spill-XXXXXX", spill_dir);
+  fd = mkstemp(path);
+  if (fd < 0) {
+    printf("ERROR: can't create a temporary file in %s\n", spill_dir);
+    exit(1);
+  }
+  unlink(path);
+  f = fdopen(fd, "w+b");
+  if (f == NULL) {
+    printf("ERROR: can't create a temporary file in %s\n", spill_dir);
+    exit(1);
+  }
+  return f;
+}
+
+// A run is a sequence of (count, length, string) records.
+void WriteRunRecord(FILE *f, char *word, long long cn) {
+  unsigned char len = strlen(word);
+  fwrite(&cn, sizeof(long long), 1, f);
+  fwrite(&len, 1, 1, f);
+  if (fwrite(word, 1, len, f) != len) {
+    printf("ERROR: can't write to a temporary file in %s\n", spill_dir);
+    exit(1);
+  }
+}
+
+// Reads the next record of 'r' into 'r->word' and 'r->cn'. Returns 0 at the
+// end of the run.
+int ReadRunRecord(struct spill_run *r) {
+  unsigned char len;
+  if (fread(&r->cn, sizeof(long long), 1, r->f) != 1) return 0;
+  if ((fread(&len, 1, 1, r->f) != 1) || (fread(r->word, 1, len, r->f) != len)) {
+    printf("ERROR: a temporary file in %s is truncated\n", spill_dir);
+    exit(1);
+  }
+  r->word[len] = 0;
+  return 1;
+}
+
+int SpillCompare(const void *a, const void *b) {
+  return strcmp(VocabWord(*(long long *)a), VocabWord(*(long long *)b));
+}
+
+// Moves 'heap[i]' down the heap of runs until its word is no larger than
+// its children's.
+void SiftRun(struct spill_run *runs, int *heap, int size, int i) {
+  int child, top;
+  while ((child = 2 * i + 1) < size) {
+    if ((child + 1 < size) && (strcmp(runs[heap[child + 1]].word, runs[heap[child]].word) < 0)) child++;
+    if (strcmp(runs[heap[child]].word, runs[heap[i]].word) >= 0) break;
+    top = heap[i];
+    heap[i] = heap[child];
+    heap[child] = top;
+    i = child;
+  }
+}
+
+/**
+ * ======== MergeRuns ========
+ * Merges the 'n' runs in 'runs', adding up the counts of each word, and
+ * closes them. The merged words are written to 'out' as another run or, if
+ * 'out' is NULL, the ones with at least 'min_count' occurrences are added
+ * to the (empty) vocab, after </s>.
+ */
+void MergeRuns(struct spill_run *runs, int n, FILE *out) {
+  int heap[SPILL_MAX_RUNS], size = 0, a;
+  char word[MAX_STRING];
+  long long cn, i;
+  
+  // Keep the runs which aren't finished in a min-heap by their next word.
+  for (a = 0; a < n; a++) {
+    rewind(runs[a].f);
+    if (ReadRunRecord(&runs[a])) heap[size++] = a;
+  }
+  for (a = size / 2 - 1; a >= 0; a--) SiftRun(runs, heap, size, a);
+  if (out == NULL) AddWordToVocab((char *)"</s>");
+  
+  while (size > 0) {
+    // Take the smallest word, and add up its count over all of the runs.
+    strcpy(word, runs[heap[0]].word);
+    cn = 0;
+    while ((size > 0) && !strcmp(runs[heap[0]].word, word)) {
+      cn += runs[heap[0]].cn;
+      if (!ReadRunRecord(&runs[heap[0]])) heap[0] = heap[--size];
+      SiftRun(runs, heap, size, 0);
+    }
+    
+    if (out != NULL) WriteRunRecord(out, word, cn);
+    else if (!strcmp(word, "</s>")) vocab_cn[0] += cn;
+    else if (cn >= min_count) {
+      i = AddWordToVocab(word);
+      vocab_cn[i] = cn;
+    }
+  }
+  for (a = 0; a < n; a++) fclose(runs[a].f);
+}
+
+/**
+ * ======== SpillVocab ========
+ * Writes the words counted so far to a new run, sorted by string, and
+ * empties the vocab.
+ */
+void SpillVocab() {
+  long long a, *order = (long long *)malloc(vocab_size * sizeof(long long));
+  FILE *f;
+  if (order == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < vocab_size; a++) order[a] = a;
+  qsort(order, vocab_size, sizeof(long long), SpillCompare);
+  
+  // Make room for the new run by merging the others.
+  if (num_spill_runs == SPILL_MAX_RUNS) {
+    f = CreateSpillFile();
+    MergeRuns(spill_runs, num_spill_runs, f);
+    spill_runs[0].f = f;
+    num_spill_runs = 1;
+  }
+  f = CreateSpillFile();
+  for (a = 0; a < vocab_size; a++) WriteRunRecord(f, VocabWord(order[a]), vocab_cn[order[a]]);
+  fflush(f);
+  spill_runs[num_spill_runs++].f = f;
+  free(order);
+  if (debug_mode > 1) {
+    printf("Wrote %lld words to temporary run %d\n", vocab_size, num_spill_runs);
+    fflush(stdout);
+  }
+  
+  // Start over, keeping the hash table at its current size.
+  vocab_size = 0;
+  vocab_strings.size = 0;
+  InitVocabHash(vocab_hash_size / 2);
+}
+
+/**
+ * ======== MergeSpilledVocab ========
+ * Called at the end of the training file, once words have been spilled:
+ * spills the rest, and merges all of the runs into the vocab.
+ */
+void MergeSpilledVocab() {
+  SpillVocab();
+  vocab_strings.size = 0;
+  InitVocabHash(0);
+  MergeRuns(spill_runs, num_spill_runs, NULL);
+  num_spill_runs = 0;
+}
+
 /**
  * ======== LearnVocabFromTrainFile ========
  * Builds a vocabulary from the words found in the training file.
  *
  * This function will also build a hash table which allows for fast lookup
- * from the word string to the corresponding vocab_word object.
+ * from the word string to the word's index in the vocabulary.
  *
  * Words that occur fewer than 'min_count' times will be filtered out of
  * vocabulary.
  */
 void LearnVocabFromTrainFile() {
   char word[MAX_STRING], last_word[MAX_STRING], bigram_word[MAX_STRING * 2];
-  FILE *fin;
+  struct text_reader *fin;
   long long a, i, start = 1;
   
-  // Initialize the hash table to -1.
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  // Empty the hash table.
+  InitVocabHash(0);
   
   // Open the training text file.
-  fin = fopen(train_file, "rb");
+  fin = OpenReader(train_file);
   if (fin == NULL) {
     printf("ERROR: training data file not found!\n");
     exit(1);
@@ -289,10 +1128,8 @@ void LearnVocabFromTrainFile() {
   
   while (1) {
     // Read the next word from the file into the string 'word'.
-    ReadWord(word, fin);
-    
     // Stop when we've reached the end of the file.
-    if (feof(fin)) break;
+    if (!ReadWordCopy(word, fin)) break;
     
     // If word is the token </s> then set start = 1 and skip it.
     if (!strcmp(word, "</s>")) {
@@ -318,10 +1155,14 @@ void LearnVocabFromTrainFile() {
       a = AddWordToVocab(word);
       
       // Initialize the word frequency to 1.
-      vocab[a].cn = 1;
+      vocab_cn[a] = 1;
+      
+      // With '-vocab-memory', write the counts out once they fill the
+      // budget.
+      if ((vocab_memory > 0) && ((VocabMemory() > vocab_memory) || (vocab_size > vocab_size_limit))) SpillVocab();
       
     // If it's already in the vocab, just increment the word count.  
-    } else vocab[i].cn++;
+    } else vocab_cn[i]++;
     
     // TODO - This shouldn't be reachable...
     if (start) continue;
@@ -342,15 +1183,16 @@ void LearnVocabFromTrainFile() {
     // If not, add it to the vocabulary.
     if (i == -1) {
       a = AddWordToVocab(bigram_word);
-      vocab[a].cn = 1;
-    } else vocab[i].cn++;
+      vocab_cn[a] = 1;
+      if ((vocab_memory > 0) && ((VocabMemory() > vocab_memory) || (vocab_size > vocab_size_limit))) SpillVocab();
+    } else vocab_cn[i]++;
     
     // If the vocabulary has grown too large, trim out the most infrequent 
-    // words. The vocabulary is considered "too large" when it's filled more
-    // than 70% of the hash table (this is to try and keep hash collisions
-    // down).
-    if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
+    // words. The vocabulary is considered "too large" when it has more than
+    // 'vocab_size_limit' entries.
+    if (vocab_size > vocab_size_limit) ReduceVocab();
   }
+  if (num_spill_runs > 0) MergeSpilledVocab();
   
   // Sort the vocabulary in descending order by number of word occurrences.
   // Remove (and free the associated memory) for all the words that occur
@@ -364,7 +1206,7 @@ void LearnVocabFromTrainFile() {
     printf("Words in train file: %lld\n", train_words);
   }
   
-  fclose(fin);
+  CloseReader(fin);
 }
 
 /**
@@ -430,7 +1272,8 @@ void TrainModel() {
   
   real score;
   
-  FILE *fo, *fin;
+  FILE *fo;
+  struct text_reader *fin;
   
   printf("Starting training using file %s\n", train_file);
   
@@ -444,7 +1287,7 @@ void TrainModel() {
   
   // The training file was opened, read, and closed in the previous step.
   // Now we need to open the training file and the output file.
-  fin = fopen(train_file, "rb");
+  fin = OpenReader(train_file);
   fo = fopen(output_file, "wb");
   
   word[0] = 0;
@@ -456,10 +1299,8 @@ void TrainModel() {
     strcpy(last_word, word);
     
     // Read the next word (word B) from the training file.
-    ReadWord(word, fin);
-    
     // Check for the end of the training file.
-    if (feof(fin)) 
+    if (!ReadWordCopy(word, fin)) 
       break;
     
     // If the word is the </s> token, then just write a newline and continue
@@ -489,7 +1330,7 @@ void TrainModel() {
       oov = 1; 
     // Otherwise, lookup the word's frequency and store it in 'pb'.
     else 
-      pb = vocab[i].cn;
+      pb = vocab_cn[i];
     
     // If word A wasn't in the vocab, then don't combine A and B.
     if (li == -1) 
@@ -511,7 +1352,7 @@ void TrainModel() {
       oov = 1;
     // Otherwise, lookup the count for the combined word and store it in 'pab'.
     else 
-      pab = vocab[i].cn;
+      pab = vocab_cn[i];
     
     // Don't combine the words if either word A or word B occur fewer than 
     // min_count (default = 5) times in the training text.
@@ -546,7 +1387,7 @@ void TrainModel() {
   }
   
   fclose(fo);
-  fclose(fin);
+  CloseReader(fin);
 }
 
 int ArgPos(char *str, int argc, char **argv) {
@@ -568,13 +1409,20 @@ int main(int argc, char **argv) {
     printf("Options:\n");
     printf("Parameters for training:\n");
     printf("\t-train <file>\n");
-    printf("\t\tUse text data from <file> to train the model\n");
+    printf("\t\tUse text data from <file> to train the model; gzip and zstd files are decompressed as they are read\n");
     printf("\t-output <file>\n");
     printf("\t\tUse <file> to save the resulting word vectors / word clusters / phrases\n");
     printf("\t-min-count <int>\n");
     printf("\t\tThis will discard words that appear less than <int> times; default is 5\n");
     printf("\t-threshold <float>\n");
     printf("\t\t The <float> value represents threshold for forming the phrases (higher means less phrases); default 100\n");
+    printf("\t-vocab-memory <int>\n");
+    printf("\t\tCount the words and pairs exactly in about <int> MB of memory, writing partial counts to temporary\n");
+    printf("\t\tfiles when they don't fit; default is 0 (no limit)\n");
+    printf("\t-spill-dir <dir>\n");
+    printf("\t\tWrite the temporary files of -vocab-memory to <dir>; default is $TMPDIR, or /tmp\n");
+    printf("\t-threads <int>\n");
+    printf("\t\tUse <int> threads to sort the vocabulary (default 12)\n");
     printf("\t-debug <int>\n");
     printf("\t\tSet the debug mode (default = 2 = more info during training)\n");
     printf("\nExamples:\n");
@@ -586,12 +1434,17 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-threshold", argc, argv)) > 0) threshold = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-vocab-memory", argc, argv)) > 0) vocab_memory = atoll(argv[i + 1]) << 20;
+  snprintf(spill_dir, MAX_STRING, "%s", (getenv("TMPDIR") != NULL) ? getenv("TMPDIR") : "/tmp");
+  if ((i = ArgPos((char *)"-spill-dir", argc, argv)) > 0) strcpy(spill_dir, argv[i + 1]);
   
   // Allocate the Vocabulary - TODO...
-  vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
+  vocab_cn = (long long *)calloc(vocab_max_size, sizeof(long long));
+  vocab_str = (long long *)calloc(vocab_max_size, sizeof(long long));
   
-  // Allocate the vocabulary hash - TODO...
-  vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
+  // Allocate the vocabulary hash, which grows with the vocabulary.
+  InitVocabHash(0);
   
   // Run phrase detection.
   TrainModel();
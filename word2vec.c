@@ -12,70 +12,166 @@
 //  See the License for the specific language governing permissions and
 //  limitations under the License.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <sched.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define MAX_STRING 100
 #define EXP_TABLE_SIZE 1000
 #define MAX_EXP 6
 #define MAX_SENTENCE_LENGTH 1000
 #define MAX_CODE_LENGTH 40
+#define SHARED_NEG_BLOCK 64
 
 /*
- * The size of the hash table for the vocabulary.
- * The vocabulary won't be allowed to grow beyond 70% of this number.
- * For instance, if the hash table has 30M entries, then the maximum
- * vocab size is 21M. This is to minimize the occurrence (and performance
- * impact) of hash collisions.
+ * The maximum size of the vocabulary. When building the vocabulary, the
+ * least frequent words are pruned (see ReduceVocab) whenever it grows beyond
+ * this. The hash table is sized to the vocabulary (see 'vocab_hash').
  */
-const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
+const long long vocab_size_limit = 21000000;  // Maximum 21M words in the vocabulary
 
 typedef float real;                    // Precision of float numbers
 
-/**
- * ======== vocab_word ========
- * Properties:
- *   cn - The word frequency (number of times it appears).
- *   word - The actual string word.
- */
-struct vocab_word {
-  long long cn;
-  int *point;
-  char *word, *code, codelen;
-};
-
 /*
  * ======== Global Variables ========
  *
  */
 char train_file[MAX_STRING], output_file[MAX_STRING];
 char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING];
+char ids_file[MAX_STRING];
+
+// Set when the training data is streamed (see "Streaming Input"): 1 for
+// stdin or a named pipe, 2 for a compressed file which is streamed again
+// for each iteration.
+int stream = 0;
+
+// READER_TEXT, READER_GZIP or READER_ZSTD (see "Compressed Input").
+int train_format = 0;
 
 /*
  * ======== vocab ========
- * This array will hold all of the words in the vocabulary.
- * This is internal state.
+ * The words in the vocabulary, as parallel arrays indexed by vocab index:
+ *   vocab_cn  - The word frequency (number of times it appears).
+ *   vocab_str - Where the word's string starts in 'vocab_strings'.
+ *
+ * The strings are packed one after another, null-terminated, into a single
+ * 'string_arena' instead of being allocated one by one; use VocabWord(i)
+ * to get word i. Keeping the counts in an array of their own means the
+ * loops over counts (sorting, the unigram table, subsampling) read 8 bytes
+ * per word. This is internal state.
+ */
+struct string_arena {
+  char *data;
+  long long size, max_size;
+};
+
+long long *vocab_cn, *vocab_str;
+struct string_arena vocab_strings;
+
+/*
+ * ======== Huffman Codes ========
+ * For hierarchical softmax, each word's path from the root of the Huffman
+ * tree (see CreateBinaryTree) is stored in three flat arrays, laid out like
+ * a sparse (CSR) matrix:
+ *
+ *   code_start  - Word w's path is entries [code_start[w], code_start[w + 1]).
+ *   code_points - For each entry, the inner node's row of the output matrix.
+ *   code_bits   - For each entry, the code (0 or 1), packed 8 per byte.
+ *
+ * One word's path is a single contiguous run, so the HS loop reads it with
+ * a couple of cache lines. These are only allocated with '-hs 1'.
  */
-struct vocab_word *vocab;
+long long *code_start;
+int *code_points;
+unsigned char *code_bits;
+
+/*
+ * ======== HS Private Rows ========
+ * Every HS update walks down from the root of the Huffman tree, so the syn1
+ * rows of the top few levels are written by every thread for almost every
+ * word, and their cache lines bounce between the cores.
+ *
+ * With '-hs-private K', each thread instead trains its own copy of the rows
+ * in the top K levels of the tree (at most 2^K - 1 rows). Every
+ * 'hs_private_sync' words the thread merges its copy back into syn1 (see
+ * MergeHsPrivate). The deeper rows are shared as before.
+ *
+ * 'hs_private_slot' maps a syn1 row to its index in the private copies, or
+ * -1. 'hs_private_row' is the reverse mapping.
+ */
+int hs_private_levels = 0, hs_private_rows = 0;
+long long hs_private_sync = 1000;
+int *hs_private_slot, *hs_private_row;
+
+/*
+ * ======== Hot Rows ========
+ * SortVocab puts the most frequent words first, so the syn0 and syn1neg rows
+ * with the lowest ids are written by every thread for a large share of the
+ * training pairs, and the most frequent words are also the ones drawn most
+ * often as negative samples.
+ *
+ * With '-hot-words N', each thread trains its own copy of rows [0, N) of
+ * syn0 and syn1neg instead, and every 'hot_sync' words merges the rows it
+ * changed back into the shared matrices (see MergeHotRows). The rest of the
+ * vocabulary is trained in place as before.
+ *
+ * 'dirty' marks the rows the thread has changed since its last merge; the
+ * other rows are only refreshed from the shared matrix, so they cost no
+ * shared writes.
+ */
+struct hot_copy {
+  real *rows, *base;
+  unsigned char *dirty;
+};
+long long hot_words = 0, hot_sync = 2000;
 
 int binary = 0, cbow = 1, debug_mode = 2, window = 5, min_count = 5, num_threads = 12, min_reduce = 1;
 
 /*
  * ======== vocab_hash ========
- * This array is the hash table for the vocabulary. Word strings are hashed
- * to a hash code (an integer), then the hash code is used as the index into
- * 'vocab_hash', to retrieve the index of the word within the 'vocab' array.
+ * This is the hash table for the vocabulary. Word strings are hashed to a
+ * 64-bit hash code (see GetWordHash), and the low bits of the hash code pick
+ * the slot in 'vocab_hash' which holds the index of the word within the
+ * 'vocab' array. Collisions go to the next free slot (linear probing).
+ *
+ * Each slot also keeps the high 32 bits of the word's hash code as a
+ * "fingerprint". A lookup only reads the word's string when the fingerprint
+ * matches, so probing past other words almost never touches 'vocab'.
+ *
+ * 'vocab_hash_size' is a power of two. The table grows (doubling) to stay at
+ * most 70% full, and is sized to the vocabulary when it is rebuilt, so its
+ * size follows the vocabulary rather than a fixed maximum. At
+ * 'vocab_size_limit' entries it has the smallest power of two slots which
+ * holds them at that load.
  */
-int *vocab_hash;
+struct vocab_slot {
+  unsigned int fp; // High 32 bits of the word's hash code.
+  int index;       // Index of the word in 'vocab', or -1 for an empty slot.
+};
+
+struct vocab_slot *vocab_hash = NULL;
+long long vocab_hash_size = 0, vocab_hash_used = 0;
 
 /*
  * ======== vocab_max_size ========
  * This is not a limit on the number of words in the vocabulary, but rather
- * a chunk size for allocating the vocabulary table. The vocabulary table will
- * be expanded as necessary, and is allocated, e.g., 1,000 words at a time.
+ * the number of words the vocab arrays have room for. They start with room
+ * for 1,000 words, and double in size whenever they fill up.
  *
  * ======== vocab_size ========
  * Stores the number of unique words in the vocabulary. 
@@ -90,11 +186,18 @@ long long vocab_max_size = 1000, vocab_size = 0, layer1_size = 100;
 /*
  *
  */
-long long train_words = 0, word_count_actual = 0, iter = 5, file_size = 0, classes = 0;
+long long train_words = 0, iter = 5, file_size = 0, classes = 0;
+
+// The total of vocab_cn[], which subsampling divides by to get each word's
+// frequency. This is 'train_words', except after '-init-model' merges in
+// the counts of an earlier model (see MergeModelVocab).
+long long count_words = 0;
 
 /*
  * ======== alpha ========
  * TODO - This is a learning rate parameter.
+ * Only the starting value lives here; each training thread decays its own
+ * copy, 'local_alpha', as training progresses.
  *
  * ======== starting_alpha ========
  *
@@ -121,14 +224,543 @@ real alpha = 0.025, starting_alpha, sample = 1e-3;
  *
  * ======== expTable ========
  * Stores precalcultaed activations for the output layer.
+ *
+ * ======== syn0_bf16, syn1neg_bf16 ========
+ * With '-bf16 1', syn0 and syn1neg are stored in these bfloat16 arrays
+ * instead, at half the memory and bandwidth (see "bf16 Storage"). syn0 is
+ * only filled in (in fp32) after training, for saving.
  */
 real *syn0, *syn1, *syn1neg, *expTable;
+int bf16 = 0;
+unsigned short *syn0_bf16, *syn1neg_bf16;
+
+/*
+ * ======== corpus_ids ========
+ * When '-ids <file>' is given, the training text is converted once into a
+ * stream of vocab ids (see InitIdsCorpus), and that file is memory mapped
+ * here. The training threads then read ids directly instead of parsing and
+ * hashing the text on every epoch.
+ *
+ * ======== corpus_num_ids ========
+ * The number of ids in 'corpus_ids', including the </s> (id 0) tokens that
+ * mark the sentence boundaries.
+ */
+int *corpus_ids = NULL;
+long long corpus_num_ids = 0;
+
+/*
+ * ======== work_chunks ========
+ * The training data is split into 'num_work_chunks' chunks which start and
+ * end on sentence boundaries. Offsets are in bytes of the training file, or
+ * in ids when training from 'corpus_ids'. See InitWorkChunks.
+ *
+ * ======== task_queues ========
+ * A task is one pass over one chunk; task 't' trains chunk
+ * 't % num_work_chunks', so there are 'iter * num_work_chunks' tasks in all.
+ * Each thread starts out owning a contiguous range of tasks, which it takes
+ * from the front. A thread which runs out steals from the back of another
+ * thread's range. The range is packed into one 64-bit word as
+ * (next << 32) | end so that both ends can be updated with a single
+ * compare-and-swap. Each queue has its own cache line.
+ *
+ * ======== thread_stats ========
+ * Per-thread bookkeeping. Each thread only ever writes its own entry, and
+ * every entry has a cache line to itself, so updating the counters doesn't
+ * bounce lines between cores. 'words' is the number of training words the
+ * thread has processed so far; the total over all threads (see
+ * WordCountActual) drives the progress report and the learning rate.
+ */
+struct work_chunk {
+  long long start, end;
+};
+
+struct task_queue {
+  unsigned long long range;
+  char pad[56];
+};
+
+struct thread_stats {
+  long long words;           // Training words processed, read by other threads.
+  double busy;               // Seconds until the thread ran out of work.
+  long long chunks, stolen;  // Tasks trained, and how many of them were stolen.
+  long long row_updates;     // syn0 and syn1neg rows updated,
+  long long hot_updates;     //   how many of them were in the thread's hot rows,
+  long long merge_writes;    //   and rows written back by MergeHotRows.
+} __attribute__((aligned(64)));
+
+struct work_chunk *work_chunks;
+long long num_work_chunks = 0;
+struct task_queue *task_queues;
+struct thread_stats *thread_stats;
+double train_start_time;
 clock_t start;
 
-int hs = 0, negative = 5;
+int hs = 0, negative = 5, shared_negative = 0, alias = 0;
+unsigned long long seed = 1;
+
+/*
+ * ======== NUMA ========
+ * With '-numa 1', the training threads are split into contiguous groups, one
+ * per NUMA node, and each thread is pinned to the CPUs of its node. The
+ * weight matrices are initialized by the same threads (see InitNetThread),
+ * so the kernel's first-touch policy spreads their pages across the nodes
+ * instead of putting all of them on the node of the main thread.
+ *
+ * With '-numa 2', each node additionally gets its own replica of syn1neg,
+ * placed on that node, and its threads train against it. Every 'numa_sync'
+ * words, each thread merges its own slice of the rows across all of the
+ * replicas (see MergeReplicas). 'syn1neg' itself then only holds the merged
+ * weights.
+ *
+ * The node layout comes from /sys/devices/system/node; without it (or with
+ * '-numa 0') there is a single node holding every CPU.
+ */
+#define MAX_NUMA_NODES 64
+int numa = 0, num_numa_nodes = 1;
+long long numa_sync = 1000000;
+cpu_set_t numa_cpus[MAX_NUMA_NODES];
+real *syn1neg_replicas[MAX_NUMA_NODES];
+
+/*
+ * ======== Workers ========
+ * With '-workers N', training runs in N worker processes instead of in this
+ * one, standing in for the machines of a cluster. Each worker forks off
+ * with the vocabulary and the initial weights, trains its own shard of the
+ * training data (1/N of the work chunks) with '-threads' threads, and keeps
+ * its own copy of the weights.
+ *
+ * The workers share a master copy of syn0, syn1 and syn1neg in shared
+ * memory. Every 'worker_sync' words, each training thread syncs its slice
+ * of the rows with it (see SyncWorkerRows): the rows its worker has changed
+ * ('touched', marked after each update) since the last sync are added to
+ * the master as deltas, and
+ * the rows which other workers have changed are copied back. Every master
+ * row has a version number, so the rows nobody changed are skipped.
+ *
+ * The deltas are summed, just as the threads of one process add their
+ * updates to the same weights, so the workers have to sync often: on the
+ * test corpus CBOW got noticeably worse with 20000 words between syncs.
+ * Averaging the deltas instead undertrained the vectors badly.
+ *
+ * The process which forked the workers acts as the coordinator: it waits
+ * for them and saves the master weights.
+ *
+ * The workers also publish their threads' word counts in 'worker_shared',
+ * so the learning rate follows the progress of the whole run.
+ */
+#define WORKER_ROW_LOCKS 4096
+#define MAX_WORKERS 256
+struct worker_shared {
+  long long rows_sent, rows_synced;
+  pthread_mutex_t locks[WORKER_ROW_LOCKS];
+  long long words[];
+};
+int workers = 0, worker_id = -1;
+long long worker_sync = 10000;
+pid_t worker_pids[MAX_WORKERS];
+struct worker_shared *worker_shared;
+real *worker_master[3], *worker_base[3];
+unsigned int *worker_version[3], *worker_seen[3];
+unsigned char *syn0_touched, *syn1_touched, *syn1neg_touched;
+
+/*
+ * ======== Huge Pages ========
+ * The weight matrices and the unigram table are read at random rows, so
+ * with 4 KB pages nearly every lookup into a multi-GB matrix misses the TLB.
+ * '-hugepages 1' asks the kernel to back them with transparent 2 MB pages
+ * (madvise MADV_HUGEPAGE). '-hugepages 2' first tries explicit huge pages
+ * from the hugetlbfs pool (mmap MAP_HUGETLB), and falls back to transparent
+ * huge pages when the pool is too small.
+ *
+ * Every such allocation is recorded in 'huge_regions' so that
+ * ReportHugePages can log how much of it actually got huge pages.
+ */
+#define HUGE_PAGE_SIZE (2LL * 1024 * 1024)
+#define MAX_HUGE_REGIONS (MAX_NUMA_NODES + 8)
+struct huge_region {
+  char *p;
+  long long size;
+  int hugetlb;
+};
+int hugepages = 0, num_huge_regions = 0;
+struct huge_region huge_regions[MAX_HUGE_REGIONS];
 const int table_size = 1e8;
 int *table;
 
+/*
+ * ======== alias_table ========
+ * Walker's alias method, an alternative to the unigram 'table' for drawing
+ * negative samples ('-alias 1'). It has one entry per vocab word instead of
+ * 'table_size' entries. See InitAliasTable.
+ */
+struct alias_entry {
+  float prob;
+  int alias;
+};
+struct alias_entry *alias_table;
+
+/*
+ * ======== Vector Kernels ========
+ * The negative sampling (and hierarchical softmax) updates in TrainModelThread
+ * spend nearly all of their time in two operations over vectors of length
+ * 'layer1_size':
+ *
+ *   VecDot      - f = x . y
+ *   VecDualAxpy - e += g * y, then y += g * x
+ *
+ * plus a plain VecAxpy (y += g * x), which the shared negative skip-gram
+ * mode uses to build its matrix products.
+ *
+ * The second one fuses the "propagate errors output -> hidden" and "learn
+ * weights hidden -> output" loops so that each output row 'y' is only
+ * streamed through once per sample.
+ *
+ * With '-bf16 1' the output rows 'y' are stored in bfloat16 (see "bf16
+ * Storage"), and VecDotBf16 / VecDualAxpyBf16 do the same work as VecDot /
+ * VecDualAxpy, converting 'y' to fp32 in registers. VecDualAxpyBf16 rounds
+ * the new 'y' stochastically, using the caller's 16-bit random 'noise'.
+ *
+ * The makefile builds word2vec for the baseline instruction set, so the AVX2
+ * and AVX-512 versions below are compiled with a per-function 'target'
+ * attribute and picked at startup by InitVecKernels() using CPUID.
+ */
+real (*VecDot)(const real *x, const real *y, long long n);
+void (*VecDualAxpy)(real *e, real *y, const real *x, real g, long long n);
+void (*VecAxpy)(real *y, const real *x, real g, long long n);
+real (*VecDotBf16)(const real *x, const unsigned short *y, long long n);
+void (*VecDualAxpyBf16)(real *e, unsigned short *y, const real *x, real g, long long n,
+                        const unsigned short *noise);
+const char *vec_kernel_name = "scalar";
+
+real VecDotScalar(const real *x, const real *y, long long n) {
+  long long c;
+  real f = 0;
+  for (c = 0; c < n; c++) f += x[c] * y[c];
+  return f;
+}
+
+void VecDualAxpyScalar(real *e, real *y, const real *x, real g, long long n) {
+  long long c;
+  for (c = 0; c < n; c++) {
+    e[c] += g * y[c];
+    y[c] += g * x[c];
+  }
+}
+
+void VecAxpyScalar(real *y, const real *x, real g, long long n) {
+  long long c;
+  for (c = 0; c < n; c++) y[c] += g * x[c];
+}
+
+union float_bits {
+  float f;
+  unsigned int u;
+};
+
+real VecDotBf16Scalar(const real *x, const unsigned short *y, long long n) {
+  union float_bits v;
+  long long c;
+  real f = 0;
+  for (c = 0; c < n; c++) {
+    v.u = (unsigned int)y[c] << 16;
+    f += x[c] * v.f;
+  }
+  return f;
+}
+
+void VecDualAxpyBf16Scalar(real *e, unsigned short *y, const real *x, real g, long long n,
+                           const unsigned short *noise) {
+  union float_bits v;
+  long long c;
+  for (c = 0; c < n; c++) {
+    v.u = (unsigned int)y[c] << 16;
+    e[c] += g * v.f;
+    v.f += g * x[c];
+    y[c] = (v.u + noise[c]) >> 16;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+real VecDotAvx2(const real *x, const real *y, long long n) {
+  long long c = 0;
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  __m128 lo;
+  real f;
+  // Two accumulators hide the latency of the FMA dependency chain.
+  for (; c + 16 <= n; c += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + c), _mm256_loadu_ps(y + c), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + c + 8), _mm256_loadu_ps(y + c + 8), acc1);
+  }
+  for (; c + 8 <= n; c += 8)
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + c), _mm256_loadu_ps(y + c), acc0);
+  acc0 = _mm256_add_ps(acc0, acc1);
+  // Horizontal sum of the 8 lanes.
+  lo = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+  lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+  lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+  f = _mm_cvtss_f32(lo);
+  for (; c < n; c++) f += x[c] * y[c];
+  return f;
+}
+
+__attribute__((target("avx2,fma")))
+void VecDualAxpyAvx2(real *e, real *y, const real *x, real g, long long n) {
+  long long c = 0;
+  __m256 vg = _mm256_set1_ps(g), vy;
+  for (; c + 8 <= n; c += 8) {
+    vy = _mm256_loadu_ps(y + c);
+    _mm256_storeu_ps(e + c, _mm256_fmadd_ps(vg, vy, _mm256_loadu_ps(e + c)));
+    _mm256_storeu_ps(y + c, _mm256_fmadd_ps(vg, _mm256_loadu_ps(x + c), vy));
+  }
+  for (; c < n; c++) {
+    e[c] += g * y[c];
+    y[c] += g * x[c];
+  }
+}
+
+__attribute__((target("avx2,fma")))
+void VecAxpyAvx2(real *y, const real *x, real g, long long n) {
+  long long c = 0;
+  __m256 vg = _mm256_set1_ps(g);
+  for (; c + 8 <= n; c += 8)
+    _mm256_storeu_ps(y + c, _mm256_fmadd_ps(vg, _mm256_loadu_ps(x + c), _mm256_loadu_ps(y + c)));
+  for (; c < n; c++) y[c] += g * x[c];
+}
+
+// Loads 8 bf16 values as floats.
+__attribute__((target("avx2,fma")))
+static inline __m256 LoadBf16Avx2(const unsigned short *y) {
+  return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)y)), 16));
+}
+
+__attribute__((target("avx2,fma")))
+real VecDotBf16Avx2(const real *x, const unsigned short *y, long long n) {
+  long long c = 0;
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  __m128 lo;
+  real f;
+  for (; c + 16 <= n; c += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + c), LoadBf16Avx2(y + c), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + c + 8), LoadBf16Avx2(y + c + 8), acc1);
+  }
+  for (; c + 8 <= n; c += 8)
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + c), LoadBf16Avx2(y + c), acc0);
+  acc0 = _mm256_add_ps(acc0, acc1);
+  lo = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+  lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+  lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+  f = _mm_cvtss_f32(lo);
+  return f + VecDotBf16Scalar(x + c, y + c, n - c);
+}
+
+__attribute__((target("avx2,fma")))
+void VecDualAxpyBf16Avx2(real *e, unsigned short *y, const real *x, real g, long long n,
+                         const unsigned short *noise) {
+  long long c = 0;
+  __m256 vg = _mm256_set1_ps(g), vy;
+  __m256i v;
+  for (; c + 8 <= n; c += 8) {
+    vy = LoadBf16Avx2(y + c);
+    _mm256_storeu_ps(e + c, _mm256_fmadd_ps(vg, vy, _mm256_loadu_ps(e + c)));
+    vy = _mm256_fmadd_ps(vg, _mm256_loadu_ps(x + c), vy);
+    // Add the rounding noise below bit 16, keep the top 16 bits, and pack
+    // the 8 results (which sit in both 128-bit halves) into one register.
+    v = _mm256_add_epi32(_mm256_castps_si256(vy), _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(noise + c))));
+    v = _mm256_srli_epi32(v, 16);
+    v = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+    _mm_storeu_si128((__m128i *)(y + c), _mm256_castsi256_si128(v));
+  }
+  VecDualAxpyBf16Scalar(e + c, y + c, x + c, g, n - c, noise + c);
+}
+
+__attribute__((target("avx512f")))
+real VecDotAvx512(const real *x, const real *y, long long n) {
+  long long c = 0;
+  __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+  __mmask16 m;
+  for (; c + 32 <= n; c += 32) {
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + c), _mm512_loadu_ps(y + c), acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + c + 16), _mm512_loadu_ps(y + c + 16), acc1);
+  }
+  for (; c + 16 <= n; c += 16)
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + c), _mm512_loadu_ps(y + c), acc0);
+  // The tail is handled with a masked load rather than a scalar loop.
+  if (c < n) {
+    m = (__mmask16)((1u << (n - c)) - 1);
+    acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, x + c), _mm512_maskz_loadu_ps(m, y + c), acc1);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+void VecDualAxpyAvx512(real *e, real *y, const real *x, real g, long long n) {
+  long long c = 0;
+  __m512 vg = _mm512_set1_ps(g), vy;
+  __mmask16 m;
+  for (; c + 16 <= n; c += 16) {
+    vy = _mm512_loadu_ps(y + c);
+    _mm512_storeu_ps(e + c, _mm512_fmadd_ps(vg, vy, _mm512_loadu_ps(e + c)));
+    _mm512_storeu_ps(y + c, _mm512_fmadd_ps(vg, _mm512_loadu_ps(x + c), vy));
+  }
+  if (c < n) {
+    m = (__mmask16)((1u << (n - c)) - 1);
+    vy = _mm512_maskz_loadu_ps(m, y + c);
+    _mm512_mask_storeu_ps(e + c, m, _mm512_fmadd_ps(vg, vy, _mm512_maskz_loadu_ps(m, e + c)));
+    _mm512_mask_storeu_ps(y + c, m, _mm512_fmadd_ps(vg, _mm512_maskz_loadu_ps(m, x + c), vy));
+  }
+}
+
+__attribute__((target("avx512f")))
+void VecAxpyAvx512(real *y, const real *x, real g, long long n) {
+  long long c = 0;
+  __m512 vg = _mm512_set1_ps(g);
+  __mmask16 m;
+  for (; c + 16 <= n; c += 16)
+    _mm512_storeu_ps(y + c, _mm512_fmadd_ps(vg, _mm512_loadu_ps(x + c), _mm512_loadu_ps(y + c)));
+  if (c < n) {
+    m = (__mmask16)((1u << (n - c)) - 1);
+    _mm512_mask_storeu_ps(y + c, m, _mm512_fmadd_ps(vg, _mm512_maskz_loadu_ps(m, x + c), _mm512_maskz_loadu_ps(m, y + c)));
+  }
+}
+
+// Loads 16 bf16 values as floats.
+__attribute__((target("avx512f")))
+static inline __m512 LoadBf16Avx512(const unsigned short *y) {
+  return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)y)), 16));
+}
+
+__attribute__((target("avx512f")))
+real VecDotBf16Avx512(const real *x, const unsigned short *y, long long n) {
+  long long c = 0;
+  __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+  for (; c + 32 <= n; c += 32) {
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + c), LoadBf16Avx512(y + c), acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + c + 16), LoadBf16Avx512(y + c + 16), acc1);
+  }
+  for (; c + 16 <= n; c += 16)
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + c), LoadBf16Avx512(y + c), acc0);
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1)) + VecDotBf16Scalar(x + c, y + c, n - c);
+}
+
+__attribute__((target("avx512f")))
+void VecDualAxpyBf16Avx512(real *e, unsigned short *y, const real *x, real g, long long n,
+                           const unsigned short *noise) {
+  long long c = 0;
+  __m512 vg = _mm512_set1_ps(g), vy;
+  __m512i v;
+  for (; c + 16 <= n; c += 16) {
+    vy = LoadBf16Avx512(y + c);
+    _mm512_storeu_ps(e + c, _mm512_fmadd_ps(vg, vy, _mm512_loadu_ps(e + c)));
+    vy = _mm512_fmadd_ps(vg, _mm512_loadu_ps(x + c), vy);
+    v = _mm512_add_epi32(_mm512_castps_si512(vy), _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(noise + c))));
+    _mm256_storeu_si256((__m256i *)(y + c), _mm512_cvtepi32_epi16(_mm512_srli_epi32(v, 16)));
+  }
+  VecDualAxpyBf16Scalar(e + c, y + c, x + c, g, n - c, noise + c);
+}
+#endif
+
+/**
+ * ======== InitVecKernels ========
+ * Selects the fastest vector kernels supported by the CPU we're running on.
+ * __builtin_cpu_supports also checks that the OS has enabled the wider
+ * register state, so this is safe on older kernels and in VMs.
+ */
+void InitVecKernels() {
+  VecDot = VecDotScalar;
+  VecDualAxpy = VecDualAxpyScalar;
+  VecAxpy = VecAxpyScalar;
+  VecDotBf16 = VecDotBf16Scalar;
+  VecDualAxpyBf16 = VecDualAxpyBf16Scalar;
+  vec_kernel_name = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    VecDot = VecDotAvx512;
+    VecDualAxpy = VecDualAxpyAvx512;
+    VecAxpy = VecAxpyAvx512;
+    VecDotBf16 = VecDotBf16Avx512;
+    VecDualAxpyBf16 = VecDualAxpyBf16Avx512;
+    vec_kernel_name = "avx512";
+  } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    VecDot = VecDotAvx2;
+    VecDualAxpy = VecDualAxpyAvx2;
+    VecAxpy = VecAxpyAvx2;
+    VecDotBf16 = VecDotBf16Avx2;
+    VecDualAxpyBf16 = VecDualAxpyBf16Avx2;
+    vec_kernel_name = "avx2+fma";
+  }
+#endif
+}
+
+/**
+ * ======== AllocWeights ========
+ * Allocates 'size' bytes for a weight matrix or sampling table, with huge
+ * pages if '-hugepages' asks for them. Returns NULL on failure.
+ */
+void *AllocWeights(long long size) {
+  void *p = NULL;
+  
+  if (!hugepages || num_huge_regions == MAX_HUGE_REGIONS) {
+    if (posix_memalign(&p, 128, size)) return NULL;
+    return p;
+  }
+  
+  // Huge pages come in whole 2 MB units.
+  size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  huge_regions[num_huge_regions].size = size;
+  huge_regions[num_huge_regions].hugetlb = 0;
+#ifdef MAP_HUGETLB
+  if (hugepages > 1) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) p = NULL;
+    else huge_regions[num_huge_regions].hugetlb = 1;
+  }
+#endif
+  if (p == NULL) {
+    if (posix_memalign(&p, HUGE_PAGE_SIZE, size)) return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+  }
+  huge_regions[num_huge_regions++].p = (char *)p;
+  return p;
+}
+
+/**
+ * ======== ReportHugePages ========
+ * Prints how much of the memory from AllocWeights is backed by huge pages.
+ * Explicit huge pages always are; for transparent ones, the AnonHugePages
+ * counts of the overlapping mappings are read from /proc/self/smaps.
+ */
+void ReportHugePages() {
+  char line[1024];
+  unsigned long long lo = 0, hi = 0, a, b;
+  long long total = 0, huge = 0, kb, n, overlap = 0;
+  FILE *f;
+  
+  for (n = 0; n < num_huge_regions; n++) {
+    total += huge_regions[n].size;
+    if (huge_regions[n].hugetlb) huge += huge_regions[n].size;
+  }
+  f = fopen("/proc/self/smaps", "rb");
+  if (f != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      // Mapping header lines look like "7f12a0000000-7f12c0000000 rw-p ...".
+      if (sscanf(line, "%llx-%llx ", &a, &b) == 2 && strchr(line, '-') < strchr(line, ' ')) {
+        lo = a;
+        hi = b;
+        overlap = 0;
+        for (n = 0; n < num_huge_regions; n++) if (!huge_regions[n].hugetlb &&
+            (unsigned long long)huge_regions[n].p < hi &&
+            (unsigned long long)huge_regions[n].p + huge_regions[n].size > lo) overlap = 1;
+      } else if (overlap && sscanf(line, "AnonHugePages: %lld kB", &kb) == 1) huge += kb * 1024;
+    }
+    fclose(f);
+  }
+  printf("Huge pages: %lld MB of %lld MB\n", huge >> 20, total >> 20);
+}
+
 /**
  * ======== InitUnigramTable ========
  * This table is used to implement negative sampling.
@@ -152,10 +784,11 @@ void InitUnigramTable() {
   // resolution of the sampling. A larger unigram table means the negative 
   // samples will be selected with a probability that more closely matches the
   // probability calculated by the equation.
-  table = (int *)malloc(table_size * sizeof(int));
+  table = (int *)AllocWeights(table_size * sizeof(int));
+  if (table == NULL) {printf("Memory allocation failed\n"); exit(1);}
   
   // Calculate the denominator, which is the sum of weights for all words.
-  for (a = 0; a < vocab_size; a++) train_words_pow += pow(vocab[a].cn, power);
+  for (a = 0; a < vocab_size; a++) train_words_pow += pow(vocab_cn[a], power);
   
   // 'i' is the vocabulary index of the current word, whereas 'a' will be
   // the index into the unigram table.
@@ -163,7 +796,7 @@ void InitUnigramTable() {
   
   // Calculate the probability that we choose word 'i'. This is a fraction
   // betwee 0 and 1.
-  d1 = pow(vocab[i].cn, power) / train_words_pow;
+  d1 = pow(vocab_cn[i], power) / train_words_pow;
   
   // Loop over all positions in the table.
   for (a = 0; a < table_size; a++) {
@@ -181,7 +814,7 @@ void InitUnigramTable() {
       // Calculate the probability for the new word, and accumulate it with 
       // the probabilities of all previous words, so that we can compare d1 to
       // the percentage of the table that we have filled.
-      d1 += pow(vocab[i].cn, power) / train_words_pow;
+      d1 += pow(vocab_cn[i], power) / train_words_pow;
     }
     // Don't go past the end of the vocab. 
     // The total weights for all words should sum up to 1, so there shouldn't
@@ -191,6 +824,293 @@ void InitUnigramTable() {
   }
 }
 
+/**
+ * ======== InitAliasTable ========
+ * Builds an alias table for the same distribution as InitUnigramTable, i.e.
+ * word counts raised to the 3/4 power.
+ *
+ * Entry 'k' splits one "bucket" of probability 1 / vocab_size between word
+ * 'k' (with probability 'prob') and one other word ('alias'). To draw a
+ * word, pick a bucket uniformly at random and then flip a biased coin
+ * between its two words. Every draw touches a single 8-byte entry, and the
+ * whole table is only 8 * vocab_size bytes.
+ *
+ * The table is built with Vose's O(vocab_size) algorithm: buckets whose word
+ * has less than its fair share ('small') are topped up by words with more
+ * than their share ('large').
+ */
+void InitAliasTable() {
+  long long a, s, l, n_small = 0, n_large = 0;
+  long long *small = (long long *)malloc(vocab_size * sizeof(long long));
+  long long *large = (long long *)malloc(vocab_size * sizeof(long long));
+  double *p = (double *)malloc(vocab_size * sizeof(double));
+  double sum = 0, power = 0.75;
+  
+  alias_table = (struct alias_entry *)malloc(vocab_size * sizeof(struct alias_entry));
+  if ((alias_table == NULL) || (small == NULL) || (large == NULL) || (p == NULL)) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  
+  // Scale the weights so that the average bucket holds exactly 1.
+  for (a = 0; a < vocab_size; a++) {
+    p[a] = pow(vocab_cn[a], power);
+    sum += p[a];
+  }
+  for (a = 0; a < vocab_size; a++) {
+    p[a] = p[a] * vocab_size / sum;
+    if (p[a] < 1) small[n_small++] = a; else large[n_large++] = a;
+  }
+  
+  while (n_small && n_large) {
+    s = small[--n_small];
+    l = large[n_large - 1];
+    alias_table[s].prob = p[s];
+    alias_table[s].alias = l;
+    // Word 'l' gives up the rest of bucket 's'.
+    p[l] -= 1 - p[s];
+    if (p[l] < 1) {
+      n_large--;
+      small[n_small++] = l;
+    }
+  }
+  // Whatever is left is full up to rounding error.
+  while (n_large) {
+    l = large[--n_large];
+    alias_table[l].prob = 1;
+    alias_table[l].alias = l;
+  }
+  while (n_small) {
+    s = small[--n_small];
+    alias_table[s].prob = 1;
+    alias_table[s].alias = s;
+  }
+  free(small);
+  free(large);
+  free(p);
+}
+
+/*
+ * ======== Random Numbers ========
+ * The original code advances a 64-bit linear congruential generator,
+ *   next_random = next_random * 25214903917 + 11
+ * for every subsampling decision, window shrink and negative sample. Each
+ * step depends on the one before it, so the random numbers sit right in the
+ * training loop's dependency chain.
+ *
+ * Instead, each thread now has an 'rng_buffer' which is refilled in batches
+ * of RNG_BUFFER_SIZE numbers. The generator is xorshift128+ run as
+ * RNG_LANES independent streams side by side; the lanes only use shifts,
+ * xors and adds, so the compiler turns the refill loop into SIMD code. Taking
+ * a number out of the buffer is just a load.
+ *
+ * The lanes are seeded from '-seed' and the thread id with splitmix64, so a
+ * run with the same seed and thread count draws the same numbers.
+ */
+#define RNG_LANES 8
+#define RNG_BUFFER_SIZE 1024
+
+struct rng_buffer {
+  unsigned long long s0[RNG_LANES], s1[RNG_LANES];
+  unsigned long long buf[RNG_BUFFER_SIZE];
+  int pos;
+};
+
+// splitmix64, used only to turn the seed into well mixed lane states.
+unsigned long long SplitMix64(unsigned long long *x) {
+  unsigned long long z = (*x += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+void RngRefill(struct rng_buffer *r) {
+  long long i, l;
+  unsigned long long x, y;
+  
+  for (i = 0; i < RNG_BUFFER_SIZE; i += RNG_LANES) for (l = 0; l < RNG_LANES; l++) {
+    x = r->s0[l];
+    y = r->s1[l];
+    r->s0[l] = y;
+    x ^= x << 23;
+    r->s1[l] = x ^ y ^ (x >> 17) ^ (y >> 26);
+    r->buf[i + l] = r->s1[l] + y;
+  }
+  r->pos = 0;
+}
+
+// Seeds 'r' for thread (stream) 'stream' and fills the buffer.
+void RngSeed(struct rng_buffer *r, unsigned long long seed, unsigned long long stream) {
+  unsigned long long x = seed ^ (stream * 0xD1B54A32D192ED03ULL);
+  long long l;
+  
+  for (l = 0; l < RNG_LANES; l++) {
+    r->s0[l] = SplitMix64(&x);
+    r->s1[l] = SplitMix64(&x);
+  }
+  RngRefill(r);
+}
+
+// Returns the next 64-bit random number.
+static inline unsigned long long RngNext(struct rng_buffer *r) {
+  if (r->pos == RNG_BUFFER_SIZE) RngRefill(r);
+  return r->buf[r->pos++];
+}
+
+// Returns a random fraction in [0, 1), with 24 bits of precision.
+static inline real RngFraction(struct rng_buffer *r) {
+  return (RngNext(r) >> 40) / (real)16777216;
+}
+
+/*
+ * ======== bf16 Storage ========
+ * A bfloat16 is the top 16 bits of a float: the same sign and exponent, but
+ * only 7 bits of mantissa. Converting to float is just a shift.
+ *
+ * The training code never does math in bf16. The syn1neg rows go through
+ * the bf16 vector kernels, which convert in registers. Everything else loads
+ * the row it needs into an fp32 buffer with ReadRow, works on the buffer
+ * exactly as before, and stores the row back with WriteRow. Without
+ * '-bf16', ReadRow returns the row in place and WriteRow does nothing.
+ *
+ * An update to a weight is often much smaller than the weight's last bf16
+ * bit, so rounding to nearest would throw most of them away. WriteRow uses
+ * stochastic rounding instead: it adds 16 random bits below the cut before
+ * truncating, which rounds up with probability equal to the discarded
+ * fraction. The rounding is unbiased, so small updates survive on average.
+ */
+/*
+ * ======== noise_table ========
+ * Drawing 16 fresh random bits for every weight written would cost more
+ * than the training math itself. Instead, 'noise_table' is filled with
+ * random bits once (see InitNoiseTable), and each row written takes its
+ * rounding bits from a random offset into it. Every weight still gets a
+ * uniformly distributed value, so the rounding stays unbiased.
+ */
+#define NOISE_TABLE_SIZE 65536
+unsigned short *noise_table;
+
+void InitNoiseTable() {
+  struct rng_buffer *rng = (struct rng_buffer *)malloc(sizeof(struct rng_buffer));
+  long long a, n = NOISE_TABLE_SIZE + layer1_size;
+  
+  noise_table = (unsigned short *)malloc(n * sizeof(unsigned short));
+  if ((rng == NULL) || (noise_table == NULL)) {printf("Memory allocation failed\n"); exit(1);}
+  RngSeed(rng, seed, -1);
+  for (a = 0; a < n; a++) noise_table[a] = RngNext(rng) & 0xFFFF;
+  free(rng);
+}
+
+// Returns 'layer1_size' 16-bit random numbers for rounding one row.
+static inline const unsigned short *RngNoise(struct rng_buffer *rng) {
+  return noise_table + RngNext(rng) % NOISE_TABLE_SIZE;
+}
+
+// Converts 'n' bf16 values to floats.
+static inline void Bf16ToFloat(real *dst, const unsigned short *src, long long n) {
+  union float_bits x;
+  long long i;
+  
+  for (i = 0; i < n; i++) {
+    x.u = (unsigned int)src[i] << 16;
+    dst[i] = x.f;
+  }
+}
+
+// Converts 'n' floats to bf16, rounding to nearest even.
+void FloatToBf16Nearest(unsigned short *dst, const real *src, long long n) {
+  union float_bits x;
+  long long i;
+  
+  for (i = 0; i < n; i++) {
+    x.f = src[i];
+    dst[i] = (x.u + 0x7FFF + ((x.u >> 16) & 1)) >> 16;
+  }
+}
+
+// Converts one row of floats to bf16 with stochastic rounding.
+static inline void FloatToBf16(unsigned short *dst, const real *src, struct rng_buffer *rng) {
+  const unsigned short *noise = RngNoise(rng);
+  union float_bits x;
+  long long i;
+  
+  for (i = 0; i < layer1_size; i++) {
+    x.f = src[i];
+    dst[i] = (x.u + noise[i]) >> 16;
+  }
+}
+
+/**
+ * ======== ReadRow ========
+ * Returns row 'row' of a weight matrix as floats: either the row itself in
+ * 'layer', or, if the matrix is stored in 'layer_bf16', a converted copy
+ * in 'buf'.
+ */
+static inline real *ReadRow(real *layer, unsigned short *layer_bf16, long long row, real *buf) {
+  if (layer_bf16 == NULL) return layer + row * layer1_size;
+  Bf16ToFloat(buf, layer_bf16 + row * layer1_size, layer1_size);
+  return buf;
+}
+
+/**
+ * ======== WriteRow ========
+ * Stores a row returned by ReadRow back into 'layer_bf16'. Does nothing if
+ * the matrix is stored in fp32, since the row was updated in place.
+ */
+static inline void WriteRow(unsigned short *layer_bf16, long long row, real *buf, struct rng_buffer *rng) {
+  if (layer_bf16 != NULL) FloatToBf16(layer_bf16 + row * layer1_size, buf, rng);
+}
+
+/**
+ * ======== ReadHotRow ========
+ * Like ReadRow, except that the 'hot_words' most frequent words come from
+ * the thread's own copy 'h' (see "Hot Rows").
+ */
+static inline real *ReadHotRow(struct hot_copy *h, real *layer, unsigned short *layer_bf16, long long row, real *buf) {
+  if (row < hot_words) return h->rows + row * layer1_size;
+  return ReadRow(layer, layer_bf16, row, buf);
+}
+
+/**
+ * ======== WriteHotRow ========
+ * Stores a row returned by ReadHotRow. A hot row was updated in place, so it
+ * is just marked as changed for the next merge. Returns 1 for a hot row, so
+ * the caller can count them.
+ */
+static inline int WriteHotRow(struct hot_copy *h, unsigned short *layer_bf16, long long row, real *buf,
+                              struct rng_buffer *rng) {
+  if (row < hot_words) {
+    h->dirty[row] = 1;
+    return 1;
+  }
+  WriteRow(layer_bf16, row, buf, rng);
+  return 0;
+}
+
+/**
+ * ======== DrawNegative ========
+ * Draws a word from the unigram^0.75 distribution for use as a negative
+ * sample, using either the unigram table or the alias table. 'ran' is one
+ * 64-bit random number from RngNext.
+ *
+ * Word 0 is the end of sentence token "</s>"; if it is drawn, a uniformly
+ * random word is returned instead (this is what the training loop used to
+ * do at every call site).
+ */
+static inline long long DrawNegative(unsigned long long ran) {
+  long long k;
+  
+  if (!alias) k = table[(ran >> 16) % table_size];
+  else {
+    // The high 32 bits pick a bucket, and the low 24 bits choose between the
+    // bucket's word and its alias.
+    k = (ran >> 32) % vocab_size;
+    if ((ran & 0xFFFFFF) / (float)16777216 >= alias_table[k].prob) k = alias_table[k].alias;
+  }
+  if (k == 0) k = ran % (vocab_size - 1) + 1;
+  return k;
+}
+
 /**
  * ======== ReadWord ========
  * Reads a single word from a file, assuming space + tab + EOL to be word 
@@ -246,59 +1166,662 @@ void ReadWord(char *word, FILE *fin) {
   word[a] = 0;
 }
 
-/**
- * ======== GetWordHash ========
- * Returns hash value of a word. The hash is an integer between 0 and 
- * vocab_hash_size (default is 30E6).
+/*
+ * ======== Text Reader ========
+ * Tokenizer for the training text which replaces the fgetc-based ReadWord in
+ * the hot paths (vocab building and training).
+ *
+ * Regular files are memory mapped as a whole. Anything that can't be mapped
+ * (e.g., a pipe) is read in blocks of READER_BLOCK_SIZE bytes instead.
+ * Compressed files are decompressed into blocks as they are read; see
+ * "Compressed Input" below.
  *
- * For example, the word 'hat':
- * hash = ((((h * 257) + a) * 257) + t) % 30E6
+ * Words are returned as spans (pointer + length) into the mapping or block,
+ * so most words are never copied. The delimiter scan uses SSE2 to test 16
+ * bytes at a time. A word is only assembled in 'text_reader.word' when it
+ * contains a '\r' or runs past the end of a block; that slow path is a
+ * straight port of ReadWord, so the token semantics are the same:
+ *   - Words are separated by space, tab and newline.
+ *   - '\r' is skipped wherever it appears.
+ *   - A newline is returned as the token </s>.
+ *   - Words are truncated to MAX_STRING - 2 characters.
+ *   - A final word which isn't followed by a delimiter is dropped.
  */
-int GetWordHash(char *word) {
-  unsigned long long a, hash = 0;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % vocab_hash_size;
-  return hash;
-}
+#define READER_BLOCK_SIZE (1 << 20)
 
-/**
- * ======== SearchVocab ========
- * Lookup the index in the 'vocab' table of the given 'word'.
- * Returns -1 if the word is not found.
- * This function uses a hash table for fast lookup.
- */
-int SearchVocab(char *word) {
-  // Compute the hash value for 'word'.
-  unsigned int hash = GetWordHash(word);
+struct text_reader {
+  int fd;
+  char *data;            // The mapped file, or the current block.
+  long long len;         // Number of valid bytes in 'data'.
+  long long pos;         // Read position within 'data'.
+  long long offset;      // File offset of data[0].
+  int mapped, eof;
+  char word[MAX_STRING]; // Scratch space for the slow path.
+  
+  // Compressed input. For gzip, 'z' is the inflate state, 'zin' holds the
+  // compressed data read so far, and 'zoffset' is the offset in the
+  // compressed file just past it. 'members' is the member index being
+  // recorded (see InflateBlock). For zstd, 'child' is the decompressor.
+  z_stream *z;
+  unsigned char *zin;
+  long long zoffset, num_members, max_members;
+  int zdone, zmembers, indexing;
+  struct gz_member *members;
+  pid_t child;
+};
+
+/*
+ * ======== Compressed Input ========
+ * Training data can be gzip or zstd compressed; the format is detected from
+ * the first bytes of the file. gzip is inflated with zlib as the file is
+ * read, and zstd is piped through the 'zstd' command, which runs alongside
+ * the tokenizer as a separate process. Either way, the offsets used by
+ * ReaderTell and SeekReader count bytes of the uncompressed text, so the
+ * rest of the code doesn't need to know the data was compressed.
+ *
+ * A gzip file can be several gzip "members" back to back, e.g. from bgzip
+ * or from cat-ing separately gzipped pieces of a corpus, and each member
+ * can be inflated without the ones before it. The first reader to go
+ * through the whole file publishes where each member starts as 'gz_index',
+ * and after that SeekReader can jump to any offset by inflating from the
+ * start of the member which holds it. Readers which start at different
+ * members decompress in parallel.
+ */
+#define READER_TEXT 0
+#define READER_GZIP 1
+#define READER_ZSTD 2
+#define READER_ZIN_SIZE (1 << 18)
+
+struct gz_member {
+  long long offset;  // Where the member starts in the compressed file.
+  long long uoffset; // Where its data starts in the uncompressed text.
+};
+
+struct gz_member *gz_index = NULL;
+long long gz_index_size = 0;
+
+// Returns the format of 'file' (READER_TEXT, READER_GZIP or READER_ZSTD).
+// Only regular files are checked, since peeking at a pipe would lose data.
+int ReaderFormat(char *file) {
+  unsigned char magic[4];
+  struct stat st;
+  int format = READER_TEXT, fd;
+  if ((stat(file, &st) != 0) || !S_ISREG(st.st_mode)) return READER_TEXT;
+  if ((fd = open(file, O_RDONLY)) < 0) return READER_TEXT;
+  if (pread(fd, magic, 4, 0) == 4) {
+    if ((magic[0] == 0x1f) && (magic[1] == 0x8b)) format = READER_GZIP;
+    if ((magic[0] == 0x28) && (magic[1] == 0xb5) && (magic[2] == 0x2f) && (magic[3] == 0xfd))
+      format = READER_ZSTD;
+  }
+  close(fd);
+  return format;
+}
+
+// Starts 'zstd -dc file' and returns the read end of its output, or -1.
+int OpenZstd(char *file, pid_t *child) {
+  int p[2];
+  static const char msg[] = "ERROR: could not run zstd to decompress the input\n";
+  if (pipe(p)) return -1;
+  fcntl(p[0], F_SETFD, FD_CLOEXEC);
+  fcntl(p[1], F_SETFD, FD_CLOEXEC);
+  *child = fork();
+  if (*child == 0) {
+    dup2(p[1], 1);
+    execlp("zstd", "zstd", "-dcq", "--", file, (char *)NULL);
+    write(2, msg, sizeof(msg) - 1);
+    _exit(1);
+  }
+  close(p[1]);
+  if (*child < 0) {
+    close(p[0]);
+    return -1;
+  }
+  return p[0];
+}
+
+// Records that a gzip member starts at 'offset' in the compressed file and
+// at 'uoffset' in the text.
+void AddMember(struct text_reader *r, long long offset, long long uoffset) {
+  if (r->num_members == r->max_members) {
+    r->max_members = r->max_members * 2 + 16;
+    r->members = (struct gz_member *)realloc(r->members, r->max_members * sizeof(struct gz_member));
+  }
+  r->members[r->num_members].offset = offset;
+  r->members[r->num_members].uoffset = uoffset;
+  r->num_members++;
+}
+
+/**
+ * ======== OpenReader ========
+ * Opens 'file' for tokenizing. Returns NULL if the file can't be opened.
+ */
+struct text_reader *OpenReader(char *file) {
+  struct text_reader *r;
+  struct stat st;
+  pid_t child = 0;
+  int format = ReaderFormat(file), fd;
+  if (format == READER_ZSTD) fd = OpenZstd(file, &child);
+  else fd = strcmp(file, "-") ? open(file, O_RDONLY) : dup(0);
+  if (fd < 0) return NULL;
+  r = (struct text_reader *)calloc(1, sizeof(struct text_reader));
+  r->fd = fd;
+  r->child = child;
+  if (format == READER_GZIP) {
+    r->z = (z_stream *)calloc(1, sizeof(z_stream));
+    r->zin = (unsigned char *)malloc(READER_ZIN_SIZE);
+    r->data = (char *)malloc(READER_BLOCK_SIZE);
+    if (inflateInit2(r->z, 16 + MAX_WBITS) != Z_OK) {
+      printf("ERROR: could not initialize zlib\n");
+      exit(1);
+    }
+    r->indexing = 1;
+    AddMember(r, 0, 0);
+    return r;
+  }
+  if ((format == READER_TEXT) && (fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+    r->data = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (r->data != MAP_FAILED) {
+      r->mapped = 1;
+      r->len = st.st_size;
+      madvise(r->data, r->len, MADV_SEQUENTIAL);
+      return r;
+    }
+  }
+  r->data = (char *)malloc(READER_BLOCK_SIZE);
+  return r;
+}
+
+void CloseReader(struct text_reader *r) {
+  if (r->mapped) munmap(r->data, r->len);
+  else free(r->data);
+  if (r->z != NULL) {
+    inflateEnd(r->z);
+    free(r->z);
+    free(r->zin);
+    free(r->members);
+  }
+  close(r->fd);
+  if (r->child > 0) waitpid(r->child, NULL, 0);
+  free(r);
+}
+
+/**
+ * ======== InflateBlock ========
+ * Inflates the next block of a gzip file into 'data'. Returns 0 at the end
+ * of the file.
+ *
+ * zlib stops at the end of each member, so the stream is reset there to go
+ * on with the next one. Like gzip, anything after the last member which
+ * isn't gzip data (e.g., zero padding) is ignored. While reading from the
+ * start of the file, the reader notes where each member starts, and once it
+ * reaches the end this becomes 'gz_index' (if there isn't one yet).
+ */
+int InflateBlock(struct text_reader *r) {
+  static int warned = 0;
+  z_stream *z = r->z;
+  long long n;
+  int ret;
+  z->next_out = (unsigned char *)r->data;
+  z->avail_out = READER_BLOCK_SIZE;
+  while ((z->avail_out > 0) && !r->zdone) {
+    if (z->avail_in == 0) {
+      n = read(r->fd, r->zin, READER_ZIN_SIZE);
+      if (n <= 0) {
+        if ((z->total_in > 0) && !warned) printf("WARNING: the gzip data ends in the middle of a member\n");
+        if (z->total_in > 0) warned = 1;
+        r->zdone = 1;
+        break;
+      }
+      r->zoffset += n;
+      z->next_in = r->zin;
+      z->avail_in = n;
+    }
+    ret = inflate(z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      r->zmembers++;
+      if (r->indexing)
+        AddMember(r, r->zoffset - z->avail_in, r->offset + READER_BLOCK_SIZE - z->avail_out);
+      inflateReset(z);
+    } else if (ret != Z_OK) {
+      if ((r->zmembers > 0) && (z->total_out == 0)) {
+        r->zdone = 1;
+        break;
+      }
+      printf("ERROR: corrupt gzip data (%s)\n", z->msg != NULL ? z->msg : "unexpected end");
+      exit(1);
+    }
+  }
+  
+  // At the end, drop the member that was started after the last one.
+  if (r->zdone && r->indexing) {
+    r->indexing = 0;
+    while ((r->num_members > 1) && (r->members[r->num_members - 1].uoffset >=
+                                     r->offset + READER_BLOCK_SIZE - z->avail_out)) r->num_members--;
+    if (gz_index == NULL) {
+      gz_index = r->members;
+      gz_index_size = r->num_members;
+      r->members = NULL;
+    }
+  }
+  r->len = READER_BLOCK_SIZE - z->avail_out;
+  return r->len > 0;
+}
+
+/**
+ * ======== ReaderFill ========
+ * Reads the next block once 'data' has been consumed. Returns 0 at the end
+ * of the file.
+ */
+int ReaderFill(struct text_reader *r) {
+  long long n;
+  if (r->mapped) return 0;
+  r->offset += r->len;
+  r->pos = 0;
+  r->len = 0;
+  if (r->z != NULL) return InflateBlock(r);
+  n = read(r->fd, r->data, READER_BLOCK_SIZE);
+  if (n <= 0) return 0;
+  r->len = n;
+  return 1;
+}
+
+/**
+ * ======== SeekReader ========
+ * Moves the read position to byte 'offset' of the file.
+ */
+void SeekReader(struct text_reader *r, long long offset) {
+  r->eof = 0;
+  if (r->mapped) {
+    r->pos = offset < r->len ? offset : r->len;
+    return;
+  }
+  
+  // For gzip, inflate from the start of the member which holds 'offset'
+  // (the first member, without an index) and skip ahead to it.
+  if (r->z != NULL) {
+    long long lo = 0, hi = gz_index_size - 1, mid, start = 0, ustart = 0;
+    while (lo <= hi) {
+      mid = (lo + hi) / 2;
+      if (gz_index[mid].uoffset <= offset) {
+        start = gz_index[mid].offset;
+        ustart = gz_index[mid].uoffset;
+        lo = mid + 1;
+      } else hi = mid - 1;
+    }
+    lseek(r->fd, start, SEEK_SET);
+    inflateReset(r->z);
+    r->z->avail_in = 0;
+    r->zoffset = start;
+    r->zdone = 0;
+    r->indexing = 0;
+    r->offset = ustart;
+    r->pos = 0;
+    r->len = 0;
+    while ((r->offset + r->len <= offset) && ReaderFill(r));
+    r->pos = offset - r->offset < r->len ? offset - r->offset : r->len;
+    return;
+  }
+  lseek(r->fd, offset, SEEK_SET);
+  r->offset = offset;
+  r->pos = 0;
+  r->len = 0;
+}
+
+// Returns the file offset of the next unread byte.
+long long ReaderTell(struct text_reader *r) {
+  return r->offset + r->pos;
+}
+
+/**
+ * ======== FindSentenceStart ========
+ * Returns the first offset at or after 'offset' in the training file which
+ * starts a sentence, i.e. the offset just past a newline. Files like text8
+ * have no newlines at all, so if none turns up within the first few MB we
+ * settle for the start of a word instead. Returns -1 if there is neither.
+ */
+long long FindSentenceStart(struct text_reader *r, long long offset) {
+  char *p;
+  long long i, n, word_start = -1;
+  SeekReader(r, offset);
+  while (ReaderTell(r) - offset < (4 << 20)) {
+    if ((r->pos >= r->len) && !ReaderFill(r)) break;
+    n = r->len - r->pos;
+    if (n > offset + (4 << 20) - ReaderTell(r)) n = offset + (4 << 20) - ReaderTell(r);
+    p = (char *)memchr(r->data + r->pos, '\n', n);
+    if (p != NULL) return r->offset + (p - r->data) + 1;
+    if (word_start < 0) for (i = r->pos; i < r->pos + n; i++) if ((r->data[i] == ' ') || (r->data[i] == '\t')) {
+      word_start = r->offset + i + 1;
+      break;
+    }
+    r->pos += n;
+  }
+  return word_start;
+}
+
+// Returns the offset in the text of the first gzip member which starts at
+// or after 'offset', or -1 if there is none (see "Compressed Input").
+long long NextMemberStart(long long offset) {
+  long long lo = 0, hi = gz_index_size - 1, mid, found = -1;
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (gz_index[mid].uoffset >= offset) {
+      found = gz_index[mid].uoffset;
+      hi = mid - 1;
+    } else lo = mid + 1;
+  }
+  return found;
+}
+
+static inline int ReaderGetc(struct text_reader *r) {
+  if ((r->pos >= r->len) && !ReaderFill(r)) return EOF;
+  return (unsigned char)r->data[r->pos++];
+}
+
+/**
+ * ======== ScanDelimiter ========
+ * Returns a pointer to the first space, tab, newline or '\r' in [p, end), or
+ * 'end' if there is none.
+ */
+static inline char *ScanDelimiter(char *p, char *end) {
+#if defined(__SSE2__)
+  const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+  const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+  __m128i v;
+  int mask;
+  while (p + 16 <= end) {
+    v = _mm_loadu_si128((const __m128i *)p);
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+                                          _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr))));
+    if (mask) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  while ((p < end) && (*p != ' ') && (*p != '\t') && (*p != '\n') && (*p != '\r')) p++;
+  return p;
+}
+
+/**
+ * ======== ReadWordSlow ========
+ * ReadWord on top of ReaderGetc, for words that the fast path in
+ * ReadWordSpan can't return in place.
+ */
+int ReadWordSlow(struct text_reader *r, char **word, int *len) {
+  int a = 0, ch;
+  while (1) {
+    ch = ReaderGetc(r);
+    if (ch == EOF) {
+      r->eof = 1;
+      return 0;
+    }
+    if (ch == 13) continue;
+    if ((ch == ' ') || (ch == '\t') || (ch == '\n')) {
+      if (a > 0) {
+        // "Put back" the newline so that it's returned as </s> next time.
+        if (ch == '\n') r->pos--;
+        break;
+      }
+      if (ch == '\n') {
+        *word = (char *)"</s>";
+        *len = 4;
+        return 1;
+      } else continue;
+    }
+    r->word[a] = ch;
+    a++;
+    if (a >= MAX_STRING - 1) a--;
+  }
+  r->word[a] = 0;
+  *word = r->word;
+  *len = a;
+  return 1;
+}
+
+/**
+ * ======== ReadWordSpan ========
+ * Reads the next word. On success, '*word' points at its characters and
+ * '*len' is its length; the word is NOT null-terminated. Returns 0 at the
+ * end of the file, and sets 'r->eof'.
+ */
+int ReadWordSpan(struct text_reader *r, char **word, int *len) {
+  char *p, *q, *end;
+  int ch;
+  
+  // Skip the spaces, tabs and CRs in front of the word.
+  while (1) {
+    if ((r->pos >= r->len) && !ReaderFill(r)) {
+      r->eof = 1;
+      return 0;
+    }
+    ch = r->data[r->pos];
+    if ((ch != ' ') && (ch != '\t') && (ch != '\r')) break;
+    r->pos++;
+  }
+  if (ch == '\n') {
+    r->pos++;
+    *word = (char *)"</s>";
+    *len = 4;
+    return 1;
+  }
+  
+  p = r->data + r->pos;
+  end = r->data + r->len;
+  q = ScanDelimiter(p, end);
+  
+  // Fast path: the word ends inside 'data' on a real delimiter.
+  if ((q < end) && (*q != '\r')) {
+    *word = p;
+    *len = q - p;
+    if (*len > MAX_STRING - 2) *len = MAX_STRING - 2;
+    // Leave a newline in place so that it's returned as </s> next time.
+    r->pos = (q - r->data) + (*q != '\n');
+    return 1;
+  }
+  
+  // At the end of a mapped file, a word without a delimiter is dropped.
+  if ((q == end) && r->mapped) {
+    r->pos = r->len;
+    r->eof = 1;
+    return 0;
+  }
+  return ReadWordSlow(r, word, len);
+}
+
+/*
+ * ======== Vocab Storage ========
+ * ArenaAdd appends a string to a 'string_arena', growing it geometrically,
+ * and returns the string's offset; offsets (unlike pointers) stay valid as
+ * the arena grows. Pruned words leave their strings behind in the arena
+ * until CompactVocabStrings repacks it.
+ */
+long long ArenaAdd(struct string_arena *a, char *word, int len) {
+  long long offset = a->size;
+  if (a->size + len + 1 > a->max_size) {
+    a->max_size = (a->size + len + 1) * 2;
+    a->data = (char *)realloc(a->data, a->max_size);
+    if (a->data == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+  }
+  memcpy(a->data + offset, word, len);
+  a->data[offset + len] = 0;
+  a->size += len + 1;
+  return offset;
+}
+
+// Returns the string of vocab word 'i'.
+static inline char *VocabWord(long long i) {
+  return vocab_strings.data + vocab_str[i];
+}
+
+// Makes room in the vocab arrays for at least 'size' words, doubling them as
+// often as needed.
+void ReserveVocab(long long size) {
+  if (size <= vocab_max_size) return;
+  while (vocab_max_size < size) vocab_max_size *= 2;
+  vocab_cn = (long long *)realloc(vocab_cn, vocab_max_size * sizeof(long long));
+  vocab_str = (long long *)realloc(vocab_str, vocab_max_size * sizeof(long long));
+  if ((vocab_cn == NULL) || (vocab_str == NULL)) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+}
+
+// Repacks the strings of the words in the vocabulary into a new arena, in
+// vocab order, leaving out the strings of words which have been dropped.
+void CompactVocabStrings() {
+  struct string_arena packed = {NULL, 0, 0};
+  long long a;
+  for (a = 0; a < vocab_size; a++) packed.max_size += strlen(VocabWord(a)) + 1;
+  packed.data = (char *)malloc(packed.max_size + 1);
+  if (packed.data == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < vocab_size; a++) vocab_str[a] = ArenaAdd(&packed, VocabWord(a), strlen(VocabWord(a)));
+  free(vocab_strings.data);
+  vocab_strings = packed;
+}
+
+/**
+ * ======== GetWordHash ========
+ * Returns the 64-bit hash of a word. The low bits pick the word's slot in
+ * 'vocab_hash', and the high 32 bits are its fingerprint.
+ *
+ * The word is mixed in 8 bytes at a time, MurmurHash3 style, followed by a
+ * final avalanche step. The original hash (hash * 257 + c, for each
+ * character c) was taken modulo a table size of 30M; a power-of-two table
+ * only looks at the low bits, so those have to depend on every character.
+ *
+ * GetWordHashSpan does the same for a word of 'len' characters which isn't
+ * null-terminated (see ReadWordSpan).
+ */
+unsigned long long GetWordHashSpan(char *word, int len) {
+  unsigned long long hash = 0x9E3779B97F4A7C15ULL ^ len, k;
+  int a, b;
+  for (a = 0; a < len; a += 8) {
+    if (len - a >= 8) memcpy(&k, word + a, 8);
+    else for (k = 0, b = len - 1; b >= a; b--) k = (k << 8) | (unsigned char)word[b];
+    k *= 0x87C37B91114253D5ULL;
+    k = (k << 31) | (k >> 33);
+    k *= 0x4CF5AD432745937FULL;
+    hash ^= k;
+    hash = ((hash << 27) | (hash >> 37)) * 5 + 0x52DCE729;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+unsigned long long GetWordHash(char *word) {
+  return GetWordHashSpan(word, strlen(word));
+}
+
+/**
+ * ======== InitVocabHash ========
+ * Empties 'vocab_hash' and sizes it for 'words' words: the smallest power of
+ * two, and at least 1024, that keeps it no more than 70% full.
+ */
+void InitVocabHash(long long words) {
+  long long a, size = 1024;
+  while (size * 7 < words * 10) size *= 2;
+  if (size != vocab_hash_size) {
+    free(vocab_hash);
+    vocab_hash = (struct vocab_slot *)malloc(size * sizeof(struct vocab_slot));
+    if (vocab_hash == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+    vocab_hash_size = size;
+  }
+  for (a = 0; a < size; a++) vocab_hash[a].index = -1;
+  vocab_hash_used = 0;
+}
+
+// Stores word 'index' of 'vocab' in the first free slot from its hash.
+void InsertVocabHash(int index) {
+  unsigned long long hash = GetWordHash(VocabWord(index));
+  long long pos = hash & (vocab_hash_size - 1);
+  while (vocab_hash[pos].index != -1) pos = (pos + 1) & (vocab_hash_size - 1);
+  vocab_hash[pos].fp = hash >> 32;
+  vocab_hash[pos].index = index;
+  vocab_hash_used++;
+}
+
+// Adds word 'index' of 'vocab' to the hash table, after doubling the table
+// if it is 70% full.
+void AddToVocabHash(int index) {
+  struct vocab_slot *old = vocab_hash;
+  long long a, old_size = vocab_hash_size;
+  if ((vocab_hash_used + 1) * 10 > vocab_hash_size * 7) {
+    vocab_hash = NULL;
+    vocab_hash_size = 0;
+    InitVocabHash(old_size);
+    for (a = 0; a < old_size; a++) if (old[a].index != -1) InsertVocabHash(old[a].index);
+    free(old);
+  }
+  InsertVocabHash(index);
+}
+
+/**
+ * ======== SearchVocab ========
+ * Lookup the index in the 'vocab' table of the given 'word'.
+ * Returns -1 if the word is not found.
+ * This function uses a hash table for fast lookup.
+ *
+ * SearchVocabSpan takes a word of 'len' characters which isn't
+ * null-terminated (see ReadWordSpan), and SearchVocabHash also takes the
+ * word's hash, when it is already known.
+ */
+int SearchVocabHash(char *word, int len, unsigned long long hash) {
+  unsigned int fp = hash >> 32;
+  long long pos = hash & (vocab_hash_size - 1);
+  char *w;
   
   // Lookup the index in the hash table, handling collisions as needed.
   // See 'AddWordToVocab' to see how collisions are handled.
   while (1) {
     // If the word isn't in the hash table, it's not in the vocab.
-    if (vocab_hash[hash] == -1) return -1;
+    if (vocab_hash[pos].index == -1) return -1;
     
     // If the input word matches the word stored at the index, we're good,
-    // return the index.
-    if (!strcmp(word, vocab[vocab_hash[hash]].word)) return vocab_hash[hash];
+    // return the index. The word is only compared if the fingerprint
+    // matches.
+    if (vocab_hash[pos].fp == fp) {
+      w = VocabWord(vocab_hash[pos].index);
+      if (!strncmp(word, w, len) && (w[len] == 0)) return vocab_hash[pos].index;
+    }
     
     // Otherwise, we need to scan through the hash table until we find it.
-    hash = (hash + 1) % vocab_hash_size;
+    pos = (pos + 1) & (vocab_hash_size - 1);
   }
   
   // This will never be reached.
   return -1;
 }
 
+int SearchVocabSpan(char *word, int len) {
+  // Compute the hash value for 'word'.
+  return SearchVocabHash(word, len, GetWordHashSpan(word, len));
+}
+
+int SearchVocab(char *word) {
+  return SearchVocabSpan(word, strlen(word));
+}
+
 /**
  * ======== ReadWordIndex ========
  * Reads the next word from the training file, and returns its index into the
  * 'vocab' table.
  */
-int ReadWordIndex(FILE *fin) {
-  char word[MAX_STRING];
-  ReadWord(word, fin);
-  if (feof(fin)) return -1;
-  return SearchVocab(word);
+int ReadWordIndex(struct text_reader *r) {
+  char *word;
+  int len;
+  if (!ReadWordSpan(r, &word, &len)) return -1;
+  return SearchVocabSpan(word, len);
 }
 
 /**
@@ -307,47 +1830,158 @@ int ReadWordIndex(FILE *fin) {
  */
 int AddWordToVocab(char *word) {
   // Measure word length.
-  unsigned int hash, length = strlen(word) + 1;
+  unsigned int length = strlen(word);
   
   // Limit string length (default limit is 100 characters).
-  if (length > MAX_STRING) length = MAX_STRING;
+  if (length > MAX_STRING - 1) length = MAX_STRING - 1;
   
-  // Allocate and store the word string.
-  vocab[vocab_size].word = (char *)calloc(length, sizeof(char));
-  strcpy(vocab[vocab_size].word, word);
+  // Store the word string in the arena.
+  vocab_str[vocab_size] = ArenaAdd(&vocab_strings, word, length);
   
   // Initialize the word frequency to 0.
-  vocab[vocab_size].cn = 0;
+  vocab_cn[vocab_size] = 0;
   
   // Increment the vocabulary size.
   vocab_size++;
   
-  // Reallocate memory if needed
-  if (vocab_size + 2 >= vocab_max_size) {
-    vocab_max_size += 1000;
-    vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
-  }
+  // Grow the vocab arrays if needed.
+  ReserveVocab(vocab_size + 2);
   
   // Add the word to the 'vocab_hash' table so that we can map quickly from the
-  // string to its vocab_word structure. 
-  
-  // Hash the word to an integer between 0 and 30E6.
-  hash = GetWordHash(word);
-  
-  // If the spot is already taken in the hash table, find the next empty spot.
-  while (vocab_hash[hash] != -1) 
-    hash = (hash + 1) % vocab_hash_size;
-  
-  // Map the hash code to the index of the word in the 'vocab' array.  
-  vocab_hash[hash] = vocab_size - 1;
+  // string to its vocab_word structure. If the word's slot is already taken
+  // in the hash table, it goes in the next empty one.
+  AddToVocabHash(vocab_size - 1);
   
   // Return the index of the word in the 'vocab' array.
   return vocab_size - 1;
 }
 
-// Used later for sorting by word counts
-int VocabCompare(const void *a, const void *b) {
-    return ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
+/*
+ * ======== Parallel Vocab Sort ========
+ * SortVocab sorts (count, index) keys rather than the vocab itself, with a
+ * least-significant-digit radix sort: one pass per byte of the 64-bit count,
+ * starting from the lowest byte, where each pass is a stable counting sort
+ * on that byte. Since every pass is stable and the keys start out in index
+ * order, words with the same count keep their order. Bytes which are the
+ * same in every count (like the high bytes, for all but enormous counts) are
+ * skipped, so most vocabularies take three or four passes.
+ *
+ * Each pass is split across 'num_threads' threads, which each own a
+ * contiguous block of the keys. Every thread counts the digits in its block;
+ * the counts are then turned into per-thread offsets, with thread 0's keys
+ * for a digit placed before thread 1's and so on, which keeps the pass
+ * stable; and then every thread moves its block to the other array.
+ */
+// A word's count and vocab index, for sorting.
+struct vocab_key {
+  long long cn, id;
+};
+
+struct radix_sort {
+  struct vocab_key *src, *dst;
+  long long size;
+  int shift, threads;
+  long long (*offsets)[256];  // offsets[thread][digit]
+  unsigned long long *diff;   // Bits that vary within each thread's block.
+};
+struct radix_sort radix;
+
+// The count as a sort key: larger counts get smaller keys, so that sorting
+// the keys in ascending order sorts the counts in descending order.
+static inline unsigned long long RadixKey(long long cn) {
+  return ~((unsigned long long)cn ^ 0x8000000000000000ULL);
+}
+
+// Gets the range of keys [start, end) in thread 'id's block.
+static inline void RadixBlock(long long id, long long *start, long long *end) {
+  *start = radix.size * id / radix.threads;
+  *end = radix.size * (id + 1) / radix.threads;
+}
+
+// Finds which bits of the keys differ within the thread's block.
+void *RadixDiffThread(void *id) {
+  long long a, start, end;
+  unsigned long long first, diff = 0;
+  RadixBlock((long long)id, &start, &end);
+  first = RadixKey(radix.src[start].cn);
+  for (a = start; a < end; a++) diff |= RadixKey(radix.src[a].cn) ^ first;
+  radix.diff[(long long)id] = diff | (first ^ RadixKey(radix.src[0].cn));
+  return NULL;
+}
+
+// Counts the digits of the current pass in the thread's block.
+void *RadixCountThread(void *id) {
+  long long a, start, end, *count = radix.offsets[(long long)id];
+  RadixBlock((long long)id, &start, &end);
+  memset(count, 0, 256 * sizeof(long long));
+  for (a = start; a < end; a++) count[(RadixKey(radix.src[a].cn) >> radix.shift) & 0xFF]++;
+  return NULL;
+}
+
+// Moves the thread's block to its place in 'dst'.
+void *RadixScatterThread(void *id) {
+  long long a, start, end, *offset = radix.offsets[(long long)id];
+  RadixBlock((long long)id, &start, &end);
+  for (a = start; a < end; a++)
+    radix.dst[offset[(RadixKey(radix.src[a].cn) >> radix.shift) & 0xFF]++] = radix.src[a];
+  return NULL;
+}
+
+/**
+ * ======== RadixSortKeys ========
+ * Sorts the 'size' keys in 'keys' by descending count, using 'tmp' (of the
+ * same size) as scratch space. Returns whichever of the two arrays holds the
+ * sorted keys.
+ */
+struct vocab_key *RadixSortKeys(struct vocab_key *keys, struct vocab_key *tmp, long long size) {
+  pthread_t *pt;
+  struct vocab_key *swap;
+  unsigned long long diff = 0;
+  long long a, b, pos;
+  
+  if (size < 2) return keys;
+  
+  // Only use as many threads as there are 64K keys to sort.
+  radix.threads = num_threads;
+  if (radix.threads > size / 65536) radix.threads = size / 65536;
+  if (radix.threads < 1) radix.threads = 1;
+  radix.size = size;
+  radix.src = keys;
+  radix.dst = tmp;
+  pt = (pthread_t *)malloc(radix.threads * sizeof(pthread_t));
+  radix.offsets = (long long (*)[256])malloc(radix.threads * sizeof(*radix.offsets));
+  radix.diff = (unsigned long long *)malloc(radix.threads * sizeof(unsigned long long));
+  
+  for (a = 0; a < radix.threads; a++) pthread_create(&pt[a], NULL, RadixDiffThread, (void *)a);
+  for (a = 0; a < radix.threads; a++) pthread_join(pt[a], NULL);
+  for (a = 0; a < radix.threads; a++) diff |= radix.diff[a];
+  
+  for (radix.shift = 0; radix.shift < 64; radix.shift += 8) {
+    // Skip the digits which are the same for every key.
+    if (((diff >> radix.shift) & 0xFF) == 0) continue;
+    
+    for (a = 0; a < radix.threads; a++) pthread_create(&pt[a], NULL, RadixCountThread, (void *)a);
+    for (a = 0; a < radix.threads; a++) pthread_join(pt[a], NULL);
+    
+    // Turn the counts into where each thread puts its first key with each
+    // digit.
+    pos = 0;
+    for (b = 0; b < 256; b++) for (a = 0; a < radix.threads; a++) {
+      long long count = radix.offsets[a][b];
+      radix.offsets[a][b] = pos;
+      pos += count;
+    }
+    
+    for (a = 0; a < radix.threads; a++) pthread_create(&pt[a], NULL, RadixScatterThread, (void *)a);
+    for (a = 0; a < radix.threads; a++) pthread_join(pt[a], NULL);
+    swap = radix.src;
+    radix.src = radix.dst;
+    radix.dst = swap;
+  }
+  free(pt);
+  free(radix.offsets);
+  free(radix.diff);
+  return radix.src;
 }
 
 /**
@@ -358,8 +1992,9 @@ int VocabCompare(const void *a, const void *b) {
  * Removing words from the vocabulary requires recomputing the hash table.
  */
 void SortVocab() {
-  int a, size;
-  unsigned int hash;
+  long long a, size;
+  long long *sorted_cn, *sorted_str;
+  struct vocab_key *keys, *tmp, *sorted;
   
   /*
    * Sort the vocabulary by number of occurrences, in descending order. 
@@ -369,11 +2004,36 @@ void SortVocab() {
    * Sorting the vocabulary this way causes the words with the fewest 
    * occurrences to be at the end of the vocabulary table. This will allow us
    * to free the memory associated with the words that get filtered out.
+   *
+   * Only the (count, index) pairs are sorted (see "Parallel Vocab Sort");
+   * the vocab arrays are then put in the sorted order.
    */
-  qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
-  
-  // Clear the vocabulary hash table.
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  keys = (struct vocab_key *)malloc(vocab_size * sizeof(struct vocab_key));
+  tmp = (struct vocab_key *)malloc(vocab_size * sizeof(struct vocab_key));
+  sorted_cn = (long long *)malloc(vocab_max_size * sizeof(long long));
+  sorted_str = (long long *)malloc(vocab_max_size * sizeof(long long));
+  if ((keys == NULL) || (tmp == NULL) || (sorted_cn == NULL) || (sorted_str == NULL)) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < vocab_size; a++) {
+    keys[a].cn = vocab_cn[a];
+    keys[a].id = a;
+  }
+  if (vocab_size > 1) sorted = RadixSortKeys(&keys[1], &tmp[1], vocab_size - 1);
+  else sorted = &keys[1];
+  sorted_cn[0] = vocab_cn[0];
+  sorted_str[0] = vocab_str[0];
+  for (a = 1; a < vocab_size; a++) {
+    sorted_cn[a] = vocab_cn[sorted[a - 1].id];
+    sorted_str[a] = vocab_str[sorted[a - 1].id];
+  }
+  free(keys);
+  free(tmp);
+  free(vocab_cn);
+  free(vocab_str);
+  vocab_cn = sorted_cn;
+  vocab_str = sorted_str;
   
   // Store the initial vocab size to use in the for loop condition.
   size = vocab_size;
@@ -384,49 +2044,40 @@ void SortVocab() {
   // For every word currently in the vocab...
   for (a = 0; a < size; a++) {
     // If it occurs fewer than 'min_count' times, remove it from the vocabulary.
-    if ((vocab[a].cn < min_count) && (a != 0)) {
+    if ((vocab_cn[a] < min_count) && (a != 0)) {
       // Decrease the size of the new vocabulary.
       vocab_size--;
-      
-      // Free the memory associated with the word string.
-      free(vocab[a].word);
-    } else {
-      // Hash will be re-computed, as after the sorting it is not actual
-      hash=GetWordHash(vocab[a].word);
-      while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-      vocab_hash[hash] = a;
-      train_words += vocab[a].cn;
-    }
+    } else train_words += vocab_cn[a];
   }
-   
-  // Reallocate the vocab array, chopping off all of the low-frequency words at
-  // the end of the table.
-  vocab = (struct vocab_word *)realloc(vocab, (vocab_size + 1) * sizeof(struct vocab_word));
   
-  // Allocate memory for the binary tree construction
-  for (a = 0; a < vocab_size; a++) {
-    vocab[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
-    vocab[a].point = (int *)calloc(MAX_CODE_LENGTH, sizeof(int));
-  }
+  // Free the memory associated with the dropped words' strings.
+  CompactVocabStrings();
+  
+  // Rebuild the hash table for the remaining words, as after the sorting it
+  // is not actual.
+  InitVocabHash(vocab_size);
+  for (a = 0; a < vocab_size; a++) InsertVocabHash(a);
+   
+  // Reallocate the vocab arrays, chopping off all of the low-frequency words
+  // at the end of the table.
+  vocab_max_size = vocab_size + 1;
+  vocab_cn = (long long *)realloc(vocab_cn, vocab_max_size * sizeof(long long));
+  vocab_str = (long long *)realloc(vocab_str, vocab_max_size * sizeof(long long));
 }
 
 // Reduces the vocabulary by removing infrequent tokens
 void ReduceVocab() {
   int a, b = 0;
-  unsigned int hash;
-  for (a = 0; a < vocab_size; a++) if (vocab[a].cn > min_reduce) {
-    vocab[b].cn = vocab[a].cn;
-    vocab[b].word = vocab[a].word;
+  for (a = 0; a < vocab_size; a++) if (vocab_cn[a] > min_reduce) {
+    vocab_cn[b] = vocab_cn[a];
+    vocab_str[b] = vocab_str[a];
     b++;
-  } else free(vocab[a].word);
-  vocab_size = b;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  for (a = 0; a < vocab_size; a++) {
-    // Hash will be re-computed, as it is not actual
-    hash = GetWordHash(vocab[a].word);
-    while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-    vocab_hash[hash] = a;
   }
+  vocab_size = b;
+  CompactVocabStrings();
+  // Hash will be re-computed, as it is not actual
+  InitVocabHash(vocab_size);
+  for (a = 0; a < vocab_size; a++) InsertVocabHash(a);
   fflush(stdout);
   min_reduce++;
 }
@@ -436,12 +2087,12 @@ void ReduceVocab() {
  * Create binary Huffman tree using the word counts.
  * Frequent words will have short unique binary codes.
  * Huffman encoding is used for lossless compression.
- * For each vocabulary word, the vocab_word structure includes a `point` array, 
- * which is the list of internal tree nodes which:
+ * For each vocabulary word, `code_points` holds the list of internal tree
+ * nodes which:
  *   1. Define the path from the root to the leaf node for the word.
  *   2. Each correspond to a row of the output matrix.
- * The `code` array is a list of 0s and 1s which specifies whether each output
- * in `point` should be trained to output 0 or 1.
+ * `code_bits` holds a list of 0s and 1s which specifies whether each output
+ * should be trained to output 0 or 1. See "Huffman Codes".
  */
 void CreateBinaryTree() {
   long long a, b, i, min1i, min2i, pos1, pos2, point[MAX_CODE_LENGTH];
@@ -461,7 +2112,7 @@ void CreateBinaryTree() {
   //     13), then we place the total weight of those subtrees into the word's
   //     position in the second half (e.g., count[vocab_size + 13]).
   //     
-  for (a = 0; a < vocab_size; a++) count[a] = vocab[a].cn;
+  for (a = 0; a < vocab_size; a++) count[a] = vocab_cn[a];
   for (a = vocab_size; a < vocab_size * 2; a++) count[a] = 1e15;
   
   // `pos1` and `pos2` are indeces into the `count` array.
@@ -547,13 +2198,23 @@ void CreateBinaryTree() {
    * ==========================================
    * [Original Comment] Now assign binary code to each vocabulary word
    * 
-   *  vocab[word]
-   *    .code - A variable-length string of 0s and 1s.
-   *    .point - A variable-length array of output row indeces.
-   *    .codelen - The length of the `code` array. 
-   *               The point array has length `codelen + 1`.
+   *  For word w, entries [code_start[w], code_start[w + 1]) hold:
+   *    code_bits - A variable-length string of 0s and 1s.
+   *    code_points - A variable-length array of output row indeces.
    * 
    */  
+  
+  // Measure every word's code length first, so that the flat arrays can be
+  // allocated in one go. The code length is the depth of the word's leaf.
+  code_start = (long long *)malloc((vocab_size + 1) * sizeof(long long));
+  code_start[0] = 0;
+  for (a = 0; a < vocab_size; a++) {
+    for (i = 0, b = a; b != vocab_size * 2 - 2; b = parent_node[b]) i++;
+    code_start[a + 1] = code_start[a] + i;
+  }
+  code_points = (int *)malloc(code_start[vocab_size] * sizeof(int));
+  code_bits = (unsigned char *)calloc((code_start[vocab_size] + 7) / 8, 1);
+  if ((code_points == NULL) || (code_bits == NULL)) {printf("Memory allocation failed\n"); exit(1);}
     
   // For each word in the vocabulary...
   for (a = 0; a < vocab_size; a++) {
@@ -582,22 +2243,42 @@ void CreateBinaryTree() {
       if (b == vocab_size * 2 - 2) break;
     }
     
-    // Record the code length (the length of the `point` list).
-    vocab[a].codelen = i;
+    // `i` is the code length, and the word's entries start at `pos1`.
+    pos1 = code_start[a];
     
     // The root node is at row `vocab_size - 2` of the output matrix. 
-    vocab[a].point[0] = vocab_size - 2;
+    code_points[pos1] = vocab_size - 2;
     
     // For each bit in this word's code...
     for (b = 0; b < i; b++) {
-      // Reverse the code in `code` and store it in `vocab[a].code`
-      vocab[a].code[i - b - 1] = code[b];
+      // Reverse the code in `code` and store it in `code_bits`.
+      if (code[b]) code_bits[(pos1 + i - b - 1) >> 3] |= 1 << ((pos1 + i - b - 1) & 7);
       
       // Store the row indeces of the internal nodes leading to this word.
       // These are the set of outputs which will be trained every time
       // this word is encountered in the training data as an output word.
-      vocab[a].point[i - b] = point[b] - vocab_size;      
+      // (point[0] is the word itself, which isn't an inner node.)
+      if (b > 0) code_points[pos1 + i - b] = point[b] - vocab_size;
+    }
+  }
+  
+  // Find the rows in the top 'hs_private_levels' levels. Inner node 'n' is
+  // row 'n - vocab_size', and a node is always created before its parent,
+  // so going down from the root visits each parent before its children.
+  // 'count' is reused to hold the depths.
+  if (hs_private_levels > 0) {
+    hs_private_slot = (int *)malloc(vocab_size * sizeof(int));
+    hs_private_row = (int *)malloc(vocab_size * sizeof(int));
+    hs_private_rows = 0;
+    for (a = vocab_size * 2 - 2; a >= vocab_size; a--) {
+      count[a] = (a == vocab_size * 2 - 2) ? 0 : count[parent_node[a]] + 1;
+      hs_private_slot[a - vocab_size] = -1;
+      if (count[a] < hs_private_levels) {
+        hs_private_slot[a - vocab_size] = hs_private_rows;
+        hs_private_row[hs_private_rows++] = a - vocab_size;
+      }
     }
+    if (debug_mode > 0) printf("HS private rows: %d\n", hs_private_rows);
   }
   free(count);
   free(binary);
@@ -605,177 +2286,2146 @@ void CreateBinaryTree() {
 }
 
 /**
- * ======== LearnVocabFromTrainFile ========
- * Builds a vocabulary from the words found in the training file.
+ * ======== MergeHsPrivate ========
+ * Merges a thread's private copy of the top HS rows into syn1. 'base'
+ * holds the rows as of the last merge, so (priv - base) is what the thread
+ * has learned since; that is added into syn1, and both copies are reset
+ * to the result.
  *
- * This function will also build a hash table which allows for fast lookup
- * from the word string to the corresponding vocab_word object.
- *
- * Words that occur fewer than 'min_count' times will be filtered out of
- * vocabulary.
+ * Like the rest of the training updates, merges take no locks. These rows
+ * get an update for nearly every word, so the threads have to merge often
+ * (every 1000 words by default): with 10000, each thread's changes were
+ * computed against weights stale enough that the summed changes overshot,
+ * and the vectors got visibly worse.
  */
-void LearnVocabFromTrainFile() {
-  char word[MAX_STRING];
-  FILE *fin;
-  long long a, i;
+void MergeHsPrivate(real *priv, real *base) {
+  long long s, c, l2;
   
-  // Populate the vocab table with -1s.
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  for (s = 0; s < hs_private_rows; s++) {
+    l2 = (long long)hs_private_row[s] * layer1_size;
+    for (c = 0; c < layer1_size; c++) {
+      syn1[l2 + c] += priv[s * layer1_size + c] - base[s * layer1_size + c];
+      priv[s * layer1_size + c] = base[s * layer1_size + c] = syn1[l2 + c];
+    }
+    // Mark the row for the worker sync (see TouchRow).
+    if (syn1_touched != NULL) syn1_touched[hs_private_row[s]] = 1;
+  }
+}
+
+/**
+ * ======== MergeHotRows ========
+ * Merges a thread's copy 'h' of the hot rows into 'layer' (or 'layer_bf16'),
+ * the same way MergeHsPrivate does: each changed row gets (rows - base)
+ * added to the shared row. Every hot row, changed or not, is then reset to
+ * the shared weights, which picks up what the other threads have learned.
+ * 'buf' is scratch for one row. Returns the number of rows written.
+ *
+ * The default interval of 2000 words keeps the copies about as fresh as the
+ * HS private rows; the negative samples for the hottest rows are drawn
+ * almost as often as the top of the Huffman tree.
+ */
+long long MergeHotRows(struct hot_copy *h, real *layer, unsigned short *layer_bf16, real *buf,
+                       struct rng_buffer *rng) {
+  long long r, c, l2, written = 0;
+  real *row;
   
-  // Open the training file.
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
-    printf("ERROR: training data file not found!\n");
+  for (r = 0; r < hot_words; r++) {
+    l2 = r * layer1_size;
+    row = ReadRow(layer, layer_bf16, r, buf);
+    if (h->dirty[r]) {
+      for (c = 0; c < layer1_size; c++) row[c] += h->rows[l2 + c] - h->base[l2 + c];
+      WriteRow(layer_bf16, r, row, rng);
+      h->dirty[r] = 0;
+      written++;
+    }
+    for (c = 0; c < layer1_size; c++) h->rows[l2 + c] = h->base[l2 + c] = row[c];
+  }
+  return written;
+}
+
+/*
+ * ======== Parallel Vocab Counting ========
+ * With more than one thread, LearnVocabFromTrainFile counts the words of a
+ * memory mapped training file in parallel. The file is split into
+ * 'num_threads' sentence-aligned ranges, and CountRangeThread counts each
+ * range into its own 'vocab_shard', which lists the range's words in the
+ * order they first appear in it.
+ *
+ * The shards are then merged in parallel by MergeShardThread, which splits
+ * the words between the threads by hash. For every word, the merge keeps
+ * its first occurrence (in the earliest range, and at the earliest position
+ * within that range) and moves the other shards' counts onto it. Reading
+ * the shards back in range order and keeping only those first occurrences
+ * gives the words in the order the serial loop would have added them, with
+ * the same counts, so SortVocab produces exactly the same vocabulary.
+ *
+ * The serial loop calls ReduceVocab once the vocabulary grows beyond
+ * 'vocab_size_limit', and that pruning depends on where in the file it
+ * happens. So if the merged vocabulary would be that large, the shards are
+ * thrown away and the words are counted by the serial loop instead.
+ */
+struct vocab_shard {
+  long long *cn, *str;        // In order of first appearance in the range.
+  struct string_arena strings;
+  unsigned long long *hashes; // GetWordHash of each word.
+  int *table;                 // Open addressing table of indices into 'words'.
+  long long size, max_size, table_bits, train_words;
+  long long start, end;       // The range of the file to count.
+  int overflow;
+};
+
+struct vocab_shard *vocab_shards;
+
+// The merge thread which handles the word with hash 'h'.
+static inline long long ShardPartition(unsigned long long h) {
+  return (h >> 24) % num_threads;
+}
+
+// Doubles the size of the table of shard 's', once it is half full.
+void GrowShardTable(struct vocab_shard *s) {
+  long long a, pos, mask;
+  s->table_bits++;
+  mask = (1LL << s->table_bits) - 1;
+  s->table = (int *)realloc(s->table, (mask + 1) * sizeof(int));
+  if (s->table == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a <= mask; a++) s->table[a] = -1;
+  for (a = 0; a < s->size; a++) {
+    pos = s->hashes[a] >> (64 - s->table_bits);
+    while (s->table[pos] != -1) pos = (pos + 1) & mask;
+    s->table[pos] = a;
+  }
+}
+
+// Returns the index of the word in shard 's', adding it if it is new.
+long long ShardAddWord(struct vocab_shard *s, char *word, int len, unsigned long long h) {
+  long long i, pos = h >> (64 - s->table_bits), mask = (1LL << s->table_bits) - 1;
+  char *w;
+  while ((i = s->table[pos]) != -1) {
+    w = s->strings.data + s->str[i];
+    if ((s->hashes[i] == h) && !strncmp(word, w, len) && (w[len] == 0)) return i;
+    pos = (pos + 1) & mask;
+  }
+  if (s->size == s->max_size) {
+    s->max_size *= 2;
+    s->cn = (long long *)realloc(s->cn, s->max_size * sizeof(long long));
+    s->str = (long long *)realloc(s->str, s->max_size * sizeof(long long));
+    s->hashes = (unsigned long long *)realloc(s->hashes, s->max_size * sizeof(unsigned long long));
+    if ((s->cn == NULL) || (s->str == NULL) || (s->hashes == NULL)) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+  }
+  i = s->size++;
+  s->str[i] = ArenaAdd(&s->strings, word, len);
+  s->cn[i] = 0;
+  s->hashes[i] = h;
+  s->table[pos] = i;
+  if (s->size * 2 > mask) GrowShardTable(s);
+  return i;
+}
+
+/**
+ * ======== CountRangeThread ========
+ * Counts the words in one range of the training file into its shard. Like
+ * the serial loop, the shard starts with </s>.
+ */
+void *CountRangeThread(void *id) {
+  struct vocab_shard *s = &vocab_shards[(long long)id];
+  struct text_reader *r = OpenReader(train_file);
+  char *span;
+  int len;
+  long long i;
+  
+  s->max_size = 1 << 16;
+  s->cn = (long long *)malloc(s->max_size * sizeof(long long));
+  s->str = (long long *)malloc(s->max_size * sizeof(long long));
+  s->hashes = (unsigned long long *)malloc(s->max_size * sizeof(unsigned long long));
+  s->table_bits = 16;
+  s->table = NULL;
+  GrowShardTable(s);
+  ShardAddWord(s, (char *)"</s>", 4, GetWordHashSpan((char *)"</s>", 4));
+  
+  // A word belongs to the range it starts in, so skip ahead to the start of
+  // the next word before checking for the end of the range.
+  SeekReader(r, s->start);
+  while (1) {
+    while ((r->pos < r->len) && ((r->data[r->pos] == ' ') || (r->data[r->pos] == '\t') ||
+                                 (r->data[r->pos] == '\r'))) r->pos++;
+    if (ReaderTell(r) >= s->end) break;
+    if (!ReadWordSpan(r, &span, &len)) break;
+    s->train_words++;
+    // ShardAddWord may grow 's->cn', so look it up only afterwards.
+    i = ShardAddWord(s, span, len, GetWordHashSpan(span, len));
+    s->cn[i]++;
+    if (s->size > vocab_size_limit) {
+      s->overflow = 1;
+      break;
+    }
+  }
+  CloseReader(r);
+  free(s->table);
+  return NULL;
+}
+
+/**
+ * ======== MergeShardThread ========
+ * Merges the words of one hash partition. The first occurrence of each word
+ * gets the total count, and the others are marked with a count of -1.
+ *
+ * 'table' holds the first occurrences found so far, as (shard << 32) | index.
+ */
+void *MergeShardThread(void *id) {
+  long long p = (long long)id, s, i, e, pos, n = 0, bits = 16, mask, a;
+  long long *table, *grown;
+  unsigned long long h;
+  long long *first;
+  
+  mask = (1LL << bits) - 1;
+  table = (long long *)malloc((mask + 1) * sizeof(long long));
+  for (a = 0; a <= mask; a++) table[a] = -1;
+  for (s = 0; s < num_threads; s++) for (i = 0; i < vocab_shards[s].size; i++) {
+    h = vocab_shards[s].hashes[i];
+    if (ShardPartition(h) != p) continue;
+    
+    // Look for an earlier occurrence of the word.
+    pos = h >> (64 - bits);
+    first = NULL;
+    while ((e = table[pos]) != -1) {
+      if ((vocab_shards[e >> 32].hashes[e & 0xFFFFFFFF] == h) &&
+          !strcmp(vocab_shards[e >> 32].strings.data + vocab_shards[e >> 32].str[e & 0xFFFFFFFF],
+                  vocab_shards[s].strings.data + vocab_shards[s].str[i])) {
+        first = &vocab_shards[e >> 32].cn[e & 0xFFFFFFFF];
+        break;
+      }
+      pos = (pos + 1) & mask;
+    }
+    if (first != NULL) {
+      *first += vocab_shards[s].cn[i];
+      vocab_shards[s].cn[i] = -1;
+      continue;
+    }
+    
+    // This is the first occurrence.
+    table[pos] = (s << 32) | i;
+    if (++n * 2 > mask) {
+      bits++;
+      mask = (1LL << bits) - 1;
+      grown = (long long *)malloc((mask + 1) * sizeof(long long));
+      for (a = 0; a <= mask; a++) grown[a] = -1;
+      for (a = 0; a <= (mask >> 1); a++) if ((e = table[a]) != -1) {
+        pos = vocab_shards[e >> 32].hashes[e & 0xFFFFFFFF] >> (64 - bits);
+        while (grown[pos] != -1) pos = (pos + 1) & mask;
+        grown[pos] = e;
+      }
+      free(table);
+      table = grown;
+    }
+  }
+  free(table);
+  return NULL;
+}
+
+/**
+ * ======== CountVocabParallel ========
+ * Counts the words of the (memory mapped) training file 'fin' into 'vocab'
+ * with 'num_threads' threads, in the order the serial loop in
+ * LearnVocabFromTrainFile would have added them. Returns 0, with 'vocab'
+ * left empty, if the serial loop has to be used instead.
+ */
+int CountVocabParallel(struct text_reader *fin) {
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  long long a, i, pos = 0, next, total = 0, size = fin->len;
+  int overflow = 0;
+  struct vocab_shard *s;
+  
+  // Split the file into sentence-aligned ranges.
+  vocab_shards = (struct vocab_shard *)calloc(num_threads, sizeof(struct vocab_shard));
+  for (a = 0; a < num_threads; a++) {
+    next = (a == num_threads - 1) ? size : FindSentenceStart(fin, size * (a + 1) / num_threads);
+    if ((next < 0) || (next > size)) next = size;
+    if (next < pos) next = pos;
+    vocab_shards[a].start = pos;
+    vocab_shards[a].end = next;
+    pos = next;
+  }
+  
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, CountRangeThread, (void *)a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  for (a = 0; a < num_threads; a++) overflow |= vocab_shards[a].overflow;
+  if (!overflow) {
+    for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, MergeShardThread, (void *)a);
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    for (a = 0; a < num_threads; a++) for (i = 0; i < vocab_shards[a].size; i++)
+      if (vocab_shards[a].cn[i] >= 0) total++;
+    if (total > vocab_size_limit) overflow = 1;
+  }
+  
+  // Gather the first occurrences, in order, into 'vocab'.
+  if (!overflow) {
+    ReserveVocab(total + 2);
+    vocab_size = 0;
+    train_words = 0;
+  }
+  for (a = 0; a < num_threads; a++) {
+    s = &vocab_shards[a];
+    if (!overflow) {
+      for (i = 0; i < s->size; i++) if (s->cn[i] >= 0) {
+        vocab_cn[vocab_size] = s->cn[i];
+        vocab_str[vocab_size] = ArenaAdd(&vocab_strings, s->strings.data + s->str[i], strlen(s->strings.data + s->str[i]));
+        vocab_size++;
+      }
+      train_words += s->train_words;
+    }
+    free(s->cn);
+    free(s->str);
+    free(s->strings.data);
+    free(s->hashes);
+  }
+  free(vocab_shards);
+  free(pt);
+  if (overflow && (debug_mode > 0)) printf("Vocabulary too large to count in parallel; counting serially\n");
+  
+  // Leave 'fin' at the end of the file, like the serial loop does, or at the
+  // start for the serial loop to run.
+  SeekReader(fin, overflow ? 0 : size);
+  return !overflow;
+}
+
+/*
+ * ======== Approximate Vocab Counting ========
+ * With '-approx-vocab <K>', the vocabulary is built in two passes over the
+ * training data, in memory which doesn't grow with the number of distinct
+ * words in it. ReduceVocab bounds the memory too, but drops counts as it
+ * goes, so which words survive it depends on the order of the data.
+ *
+ * The first pass picks the candidate words. Every word is counted in a
+ * Count-Min sketch: SKETCH_DEPTH rows of 'sketch_width' counters, where a
+ * word adds to one counter in each row (picked by its hash) and its
+ * estimated count is the smallest of those counters. Many words share each
+ * counter, so an estimate can be too high, but it is never too low, and it
+ * doesn't depend on the order of the data. Only the word's counters which
+ * are at the minimum are incremented ("conservative update"), which keeps
+ * the estimates much closer.
+ *
+ * Once a word's estimate reaches 'min_count' it is added to the vocab as a
+ * candidate. When there are 2K candidates, only the K with the highest
+ * estimates are kept (see ReduceCandidates), like a Space-Saving summary
+ * evicting its smallest counters in one batch. From then on, a word needs
+ * an estimate above the smallest one kept to become a candidate; an evicted
+ * word comes back if its estimate gets there later.
+ *
+ * The second pass counts just the candidates, exactly, and SortVocab then
+ * drops the ones below 'min_count' as usual. So the counts in the
+ * vocabulary are exact, and a word is only missing from it when more than K
+ * words have a higher estimate.
+ */
+#define SKETCH_DEPTH 4
+
+long long approx_vocab = 0;
+unsigned int *sketch = NULL;
+long long sketch_width = 0, sketch_bar = 0;
+int sketch_shift = 0;
+
+// An odd multiplier per row, which turns a word's hash into its counter in
+// that row.
+const unsigned long long sketch_mult[SKETCH_DEPTH] = {
+  0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+};
+
+// Counts one occurrence of the word with hash 'hash', and returns its new
+// estimated count.
+long long SketchAdd(unsigned long long hash) {
+  unsigned int *c[SKETCH_DEPTH], min = 0xFFFFFFFF;
+  int d;
+  for (d = 0; d < SKETCH_DEPTH; d++) {
+    c[d] = &sketch[d * sketch_width + ((hash * sketch_mult[d]) >> sketch_shift)];
+    if (*c[d] < min) min = *c[d];
+  }
+  // The counters stop at 4G, far above any 'min_count'.
+  if (min == 0xFFFFFFFF) return min;
+  for (d = 0; d < SKETCH_DEPTH; d++) if (*c[d] == min) *c[d] = min + 1;
+  return min + 1;
+}
+
+long long SketchEstimate(unsigned long long hash) {
+  unsigned int c, min = 0xFFFFFFFF;
+  int d;
+  for (d = 0; d < SKETCH_DEPTH; d++) {
+    c = sketch[d * sketch_width + ((hash * sketch_mult[d]) >> sketch_shift)];
+    if (c < min) min = c;
+  }
+  return min;
+}
+
+/**
+ * ======== ReduceCandidates ========
+ * Cuts the candidate words down to the 'approx_vocab' with the highest
+ * estimates (keeping </s>), in their current order, and raises
+ * 'sketch_bar' to the smallest estimate kept.
+ */
+void ReduceCandidates() {
+  struct vocab_key *keys, *tmp, *sorted;
+  long long a, b = 1;
+  
+  keys = (struct vocab_key *)malloc(vocab_size * sizeof(struct vocab_key));
+  tmp = (struct vocab_key *)malloc(vocab_size * sizeof(struct vocab_key));
+  if ((keys == NULL) || (tmp == NULL)) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 1; a < vocab_size; a++) {
+    keys[a - 1].cn = vocab_cn[a] = SketchEstimate(GetWordHash(VocabWord(a)));
+    keys[a - 1].id = a;
+  }
+  sorted = RadixSortKeys(keys, tmp, vocab_size - 1);
+  sketch_bar = sorted[approx_vocab - 1].cn;
+  for (a = approx_vocab; a < vocab_size - 1; a++) vocab_cn[sorted[a].id] = -1;
+  free(keys);
+  free(tmp);
+  
+  for (a = 1; a < vocab_size; a++) if (vocab_cn[a] >= 0) {
+    vocab_cn[b] = vocab_cn[a];
+    vocab_str[b] = vocab_str[a];
+    b++;
+  }
+  vocab_size = b;
+  CompactVocabStrings();
+  InitVocabHash(vocab_size);
+  for (a = 0; a < vocab_size; a++) InsertVocabHash(a);
+}
+
+/**
+ * ======== CountVocabApprox ========
+ * Builds the vocabulary from the training file 'fin' in two passes, as
+ * described above. Returns the reader of the second pass, at the end of the
+ * file.
+ */
+struct text_reader *CountVocabApprox(struct text_reader *fin) {
+  char word[MAX_STRING], *span;
+  int len;
+  long long a, i, est;
+  unsigned long long hash;
+  
+  // Size the sketch at four counters per candidate in each row.
+  sketch_width = 1024;
+  sketch_shift = 54;
+  while (sketch_width < 4 * approx_vocab) {
+    sketch_width *= 2;
+    sketch_shift--;
+  }
+  sketch = (unsigned int *)calloc(SKETCH_DEPTH * sketch_width, sizeof(unsigned int));
+  if (sketch == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  sketch_bar = 0;
+  if (debug_mode > 0) printf("Count-Min sketch: %.2f MB\n", SKETCH_DEPTH * sketch_width * sizeof(unsigned int) / 1048576.0);
+  
+  // The first pass: find the candidates.
+  AddWordToVocab((char *)"</s>");
+  while (ReadWordSpan(fin, &span, &len)) {
+    train_words++;
+    if ((debug_mode > 1) && (train_words % 100000 == 0)) {
+      printf("%lldK%c", train_words / 1000, 13);
+      fflush(stdout);
+    }
+    hash = GetWordHashSpan(span, len);
+    est = SketchAdd(hash);
+    if ((est < min_count) || (est <= sketch_bar)) continue;
+    if (SearchVocabHash(span, len, hash) != -1) continue;
+    memcpy(word, span, len);
+    word[len] = 0;
+    AddWordToVocab(word);
+    if (vocab_size > 2 * approx_vocab) ReduceCandidates();
+  }
+  free(sketch);
+  sketch = NULL;
+  if (debug_mode > 0) printf("Candidate words: %lld\n", vocab_size);
+  
+  // The second pass: count the candidates exactly.
+  CloseReader(fin);
+  fin = OpenReader(train_file);
+  if (fin == NULL) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  for (a = 0; a < vocab_size; a++) vocab_cn[a] = 0;
+  while (ReadWordSpan(fin, &span, &len)) {
+    i = SearchVocabSpan(span, len);
+    if (i != -1) vocab_cn[i]++;
+  }
+  return fin;
+}
+
+/*
+ * ======== External Vocab Counting ========
+ * With '-vocab-memory <MB>', the vocabulary is counted exactly in bounded
+ * memory, without ReduceVocab's pruning. When the words counted so far take
+ * more than 'vocab_memory' bytes (see VocabMemory), they are written out,
+ * sorted by string, to a temporary "run" file, and the vocab starts over
+ * empty (see SpillVocab). Only 'SPILL_MAX_RUNS' runs are kept open; when
+ * there are that many, they are merged into one.
+ *
+ * At the end of the file, the runs are merged (see MergeRuns): each run is
+ * in string order, so the smallest word at the front of any run is the next
+ * word overall, and its count is the sum over the runs which have it. Only
+ * the words with at least 'min_count' occurrences are added to the vocab,
+ * which then holds the exact counts, as if everything had fit in memory.
+ * The one difference is that words with the same count end up in string
+ * order, rather than in order of first appearance.
+ *
+ * The run files are unlinked as soon as they are created, so they are
+ * removed even if the program is killed. Memory use can go above the
+ * budget by up to a factor of two, because the vocab arrays grow by
+ * doubling.
+ */
+#define SPILL_MAX_RUNS 64
+
+struct spill_run {
+  FILE *f;
+  long long cn;
+  char word[MAX_STRING];
+};
+
+long long vocab_memory = 0;
+char spill_dir[MAX_STRING];
+struct spill_run spill_runs[SPILL_MAX_RUNS];
+int num_spill_runs = 0;
+
+// The memory taken by the words counted so far.
+long long VocabMemory() {
+  return vocab_size * 2 * sizeof(long long) + vocab_strings.size + vocab_hash_size * sizeof(struct vocab_slot);
+}
+
+// Creates an (already unlinked) temporary file in 'spill_dir'.
+FILE *CreateSpillFile() {
+  char path[MAX_STRING + 32];
+  FILE *f;
+  int fd;
+  snprintf(path, sizeof(path), "%s/vocab-spill-XXXXXX", spill_dir);
+  fd = mkstemp(path);
+  if (fd < 0) {
+    printf("ERROR: can't create a temporary file in %s\n", spill_dir);
+    exit(1);
+  }
+  unlink(path);
+  f = fdopen(fd, "w+b");
+  if (f == NULL) {
+    printf("ERROR: can't create a temporary file in %s\n", spill_dir);
+    exit(1);
+  }
+  return f;
+}
+
+// A run is a sequence of (count, length, string) records.
+void WriteRunRecord(FILE *f, char *word, long long cn) {
+  unsigned char len = strlen(word);
+  fwrite(&cn, sizeof(long long), 1, f);
+  fwrite(&len, 1, 1, f);
+  if (fwrite(word, 1, len, f) != len) {
+    printf("ERROR: can't write to a temporary file in %s\n", spill_dir);
+    exit(1);
+  }
+}
+
+// Reads the next record of 'r' into 'r->word' and 'r->cn'. Returns 0 at the
+// end of the run.
+int ReadRunRecord(struct spill_run *r) {
+  unsigned char len;
+  if (fread(&r->cn, sizeof(long long), 1, r->f) != 1) return 0;
+  if ((fread(&len, 1, 1, r->f) != 1) || (fread(r->word, 1, len, r->f) != len)) {
+    printf("ERROR: a temporary file in %s is truncated\n", spill_dir);
+    exit(1);
+  }
+  r->word[len] = 0;
+  return 1;
+}
+
+int SpillCompare(const void *a, const void *b) {
+  return strcmp(VocabWord(*(long long *)a), VocabWord(*(long long *)b));
+}
+
+// Moves 'heap[i]' down the heap of runs until its word is no larger than
+// its children's.
+void SiftRun(struct spill_run *runs, int *heap, int size, int i) {
+  int child, top;
+  while ((child = 2 * i + 1) < size) {
+    if ((child + 1 < size) && (strcmp(runs[heap[child + 1]].word, runs[heap[child]].word) < 0)) child++;
+    if (strcmp(runs[heap[child]].word, runs[heap[i]].word) >= 0) break;
+    top = heap[i];
+    heap[i] = heap[child];
+    heap[child] = top;
+    i = child;
+  }
+}
+
+/**
+ * ======== MergeRuns ========
+ * Merges the 'n' runs in 'runs', adding up the counts of each word, and
+ * closes them. The merged words are written to 'out' as another run or, if
+ * 'out' is NULL, the ones with at least 'min_count' occurrences are added
+ * to the (empty) vocab, after </s>.
+ */
+void MergeRuns(struct spill_run *runs, int n, FILE *out) {
+  int heap[SPILL_MAX_RUNS], size = 0, a;
+  char word[MAX_STRING];
+  long long cn, i;
+  
+  // Keep the runs which aren't finished in a min-heap by their next word.
+  for (a = 0; a < n; a++) {
+    rewind(runs[a].f);
+    if (ReadRunRecord(&runs[a])) heap[size++] = a;
+  }
+  for (a = size / 2 - 1; a >= 0; a--) SiftRun(runs, heap, size, a);
+  if (out == NULL) AddWordToVocab((char *)"</s>");
+  
+  while (size > 0) {
+    // Take the smallest word, and add up its count over all of the runs.
+    strcpy(word, runs[heap[0]].word);
+    cn = 0;
+    while ((size > 0) && !strcmp(runs[heap[0]].word, word)) {
+      cn += runs[heap[0]].cn;
+      if (!ReadRunRecord(&runs[heap[0]])) heap[0] = heap[--size];
+      SiftRun(runs, heap, size, 0);
+    }
+    
+    if (out != NULL) WriteRunRecord(out, word, cn);
+    else if (!strcmp(word, "</s>")) vocab_cn[0] += cn;
+    else if (cn >= min_count) {
+      i = AddWordToVocab(word);
+      vocab_cn[i] = cn;
+    }
+  }
+  for (a = 0; a < n; a++) fclose(runs[a].f);
+}
+
+/**
+ * ======== SpillVocab ========
+ * Writes the words counted so far to a new run, sorted by string, and
+ * empties the vocab.
+ */
+void SpillVocab() {
+  long long a, *order = (long long *)malloc(vocab_size * sizeof(long long));
+  FILE *f;
+  if (order == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < vocab_size; a++) order[a] = a;
+  qsort(order, vocab_size, sizeof(long long), SpillCompare);
+  
+  // Make room for the new run by merging the others.
+  if (num_spill_runs == SPILL_MAX_RUNS) {
+    f = CreateSpillFile();
+    MergeRuns(spill_runs, num_spill_runs, f);
+    spill_runs[0].f = f;
+    num_spill_runs = 1;
+  }
+  f = CreateSpillFile();
+  for (a = 0; a < vocab_size; a++) WriteRunRecord(f, VocabWord(order[a]), vocab_cn[order[a]]);
+  fflush(f);
+  spill_runs[num_spill_runs++].f = f;
+  free(order);
+  if (debug_mode > 1) {
+    printf("Wrote %lld words to temporary run %d\n", vocab_size, num_spill_runs);
+    fflush(stdout);
+  }
+  
+  // Start over, keeping the hash table at its current size.
+  vocab_size = 0;
+  vocab_strings.size = 0;
+  InitVocabHash(vocab_hash_size / 2);
+}
+
+/**
+ * ======== MergeSpilledVocab ========
+ * Called at the end of the training file, once words have been spilled:
+ * spills the rest, and merges all of the runs into the vocab.
+ */
+void MergeSpilledVocab() {
+  SpillVocab();
+  vocab_strings.size = 0;
+  InitVocabHash(0);
+  MergeRuns(spill_runs, num_spill_runs, NULL);
+  num_spill_runs = 0;
+}
+
+/**
+ * ======== LearnVocabFromTrainFile ========
+ * Builds a vocabulary from the words found in the training file.
+ *
+ * This function will also build a hash table which allows for fast lookup
+ * from the word string to the corresponding vocab_word object.
+ *
+ * Words that occur fewer than 'min_count' times will be filtered out of
+ * vocabulary.
+ */
+void LearnVocabFromTrainFile() {
+  char word[MAX_STRING], *span;
+  int len;
+  struct text_reader *fin;
+  long long a, i;
+  
+  // Empty the vocab hash table.
+  InitVocabHash(0);
+  
+  // Open the training file.
+  fin = OpenReader(train_file);
+  if (fin == NULL) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  
+  vocab_size = 0;
+  
+  // Count in two passes with '-approx-vocab' (see "Approximate Vocab
+  // Counting"), or in parallel if we can (see "Parallel Vocab Counting"). The
+  // loop below is then skipped. With '-vocab-memory' the loop is always used
+  // (see "External Vocab Counting").
+  if (approx_vocab > 0) fin = CountVocabApprox(fin);
+  else if ((num_threads > 1) && fin->mapped && (vocab_memory == 0) && CountVocabParallel(fin)) fin->eof = 1;
+  else {
+    // The special token </s> is used to mark the end of a sentence. In
+    // training, the context window does not go beyond the ends of a sentence.
+    //
+    // Add </s> explicitly here so that it occurs at position 0 in the vocab.
+    AddWordToVocab((char *)"</s>");
+  }
+  
+  while (!fin->eof) {
+    // Read the next word from the file. 'span' points at the word's 'len'
+    // characters inside the reader's buffer.
+    // Stop when we've reached the end of the file.
+    if (!ReadWordSpan(fin, &span, &len)) break;
+    
+    // Count the total number of tokens in the training text.
+    train_words++;
+    
+    // Print progress at every 100,000 words.
+    if ((debug_mode > 1) && (train_words % 100000 == 0)) {
+      printf("%lldK%c", train_words / 1000, 13);
+      fflush(stdout);
+    }
+    
+    // Look up this word in the vocab to see if we've already added it.
+    i = SearchVocabSpan(span, len);
+    
+    // If it's not in the vocab...
+    if (i == -1) {
+      // ...add it. Only new words need to be copied out as a string.
+      memcpy(word, span, len);
+      word[len] = 0;
+      a = AddWordToVocab(word);
+      
+      // Initialize the word frequency to 1.
+      vocab_cn[a] = 1;
+      
+      // With '-vocab-memory', write the counts out once they fill the
+      // budget.
+      if ((vocab_memory > 0) && ((VocabMemory() > vocab_memory) || (vocab_size > vocab_size_limit))) SpillVocab();
+    
+    // If it's already in the vocab, just increment the word count.
+    } else vocab_cn[i]++;
+    
+    // If the vocabulary has grown too large, trim out the most infrequent 
+    // words. The vocabulary is considered "too large" when it has more than
+    // 'vocab_size_limit' words.
+    if (vocab_size > vocab_size_limit) ReduceVocab();
+  }
+  if (num_spill_runs > 0) MergeSpilledVocab();
+  
+  // Sort the vocabulary in descending order by number of word occurrences.
+  // Remove (and free the associated memory) for all the words that occur
+  // fewer than 'min_count' times.
+  SortVocab();
+  
+  // Report the final vocabulary size, and the total number of words 
+  // (excluding those filtered from the vocabulary) in the training set.
+  if (debug_mode > 0) {
+    printf("Vocab size: %lld\n", vocab_size);
+    printf("Words in train file: %lld\n", train_words);
+  }
+  
+  file_size = ReaderTell(fin);
+  CloseReader(fin);
+}
+
+/**
+ * ======== IndexTrainFile ========
+ * Reads a gzip training file through once, for its uncompressed size and
+ * the member index (see "Compressed Input"). LearnVocabFromTrainFile gets
+ * both as a side effect; this is for when the vocabulary comes from
+ * elsewhere.
+ */
+void IndexTrainFile() {
+  struct text_reader *fin = OpenReader(train_file);
+  if (fin == NULL) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  while (ReaderFill(fin));
+  file_size = ReaderTell(fin);
+  CloseReader(fin);
+}
+
+void SaveVocab() {
+  long long i;
+  FILE *fo = fopen(save_vocab_file, "wb");
+  for (i = 0; i < vocab_size; i++) fprintf(fo, "%s %lld\n", VocabWord(i), vocab_cn[i]);
+  fclose(fo);
+}
+
+void ReadVocab() {
+  long long a, i = 0;
+  char c;
+  char word[MAX_STRING];
+  FILE *fin = fopen(read_vocab_file, "rb");
+  if (fin == NULL) {
+    printf("Vocabulary file not found\n");
+    exit(1);
+  }
+  InitVocabHash(0);
+  vocab_size = 0;
+  while (1) {
+    ReadWord(word, fin);
+    if (feof(fin)) break;
+    a = AddWordToVocab(word);
+    fscanf(fin, "%lld%c", &vocab_cn[a], &c);
+    i++;
+  }
+  SortVocab();
+  if (debug_mode > 0) {
+    printf("Vocab size: %lld\n", vocab_size);
+    printf("Words in train file: %lld\n", train_words);
+  }
+  // Streamed data has no size (see "Streaming Input"), and gzip data has to
+  // be read through to find its size.
+  if (stream || (train_format == READER_ZSTD)) return;
+  if (train_format == READER_GZIP) {
+    IndexTrainFile();
+    return;
+  }
+  fin = fopen(train_file, "rb");
+  if (fin == NULL) {
+    // A pre-tokenized copy of the training data is all we need.
+    if ((ids_file[0] != 0) && (access(ids_file, R_OK) == 0)) return;
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  fseek(fin, 0, SEEK_END);
+  file_size = ftell(fin);
+  fclose(fin);
+}
+
+/*
+ * ======== Pre-tokenized Corpus ========
+ * The ids file starts with an 'ids_header', followed by 'num_ids' 32-bit
+ * vocab ids. Words that aren't in the vocabulary are dropped when the file
+ * is written, and every newline is stored as id 0 (</s>), so each sentence
+ * is the run of ids between two zeros.
+ *
+ * The ids are only meaningful for the vocabulary they were written with, so
+ * the header records the vocab size and a checksum of the vocab words (in
+ * order). Any later run which ends up with the same vocabulary - e.g., one
+ * using '-read-vocab' with the same vocab file - reuses the ids file as is.
+ */
+struct ids_header {
+  char magic[8];
+  long long vocab_size;
+  unsigned long long vocab_checksum;
+  long long num_ids;
+};
+
+/**
+ * ======== VocabChecksum ========
+ * FNV-1a hash over the vocabulary words, in vocab order.
+ */
+unsigned long long VocabChecksum() {
+  unsigned long long h = 14695981039346656037ULL;
+  long long a;
+  char *p;
+  for (a = 0; a < vocab_size; a++) {
+    for (p = VocabWord(a); *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    h = (h ^ '\n') * 1099511628211ULL;
+  }
+  return h;
+}
+
+/**
+ * ======== WriteIdsFile ========
+ * Converts the training text into an ids file. The file is written under a
+ * temporary name and renamed into place, so concurrent jobs never see a
+ * partially written file.
+ */
+void WriteIdsFile(struct ids_header *hdr) {
+  char tmp_file[MAX_STRING + 32];
+  int buf[4096];
+  long long n = 0, word;
+  struct text_reader *fin;
+  FILE *fo;
+  
+  fin = OpenReader(train_file);
+  if (fin == NULL) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  sprintf(tmp_file, "%s.tmp.%d", ids_file, (int)getpid());
+  fo = fopen(tmp_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write ids file %s\n", tmp_file);
+    exit(1);
+  }
+  // The header is written again at the end, once 'num_ids' is known.
+  fwrite(hdr, sizeof(struct ids_header), 1, fo);
+  while (1) {
+    word = ReadWordIndex(fin);
+    if (fin->eof) break;
+    // Drop words which aren't in the vocabulary.
+    if (word == -1) continue;
+    buf[n % 4096] = word;
+    n++;
+    if (n % 4096 == 0) fwrite(buf, sizeof(int), 4096, fo);
+  }
+  fwrite(buf, sizeof(int), n % 4096, fo);
+  hdr->num_ids = n;
+  fseek(fo, 0, SEEK_SET);
+  fwrite(hdr, sizeof(struct ids_header), 1, fo);
+  CloseReader(fin);
+  if (fclose(fo) != 0 || rename(tmp_file, ids_file) != 0) {
+    printf("ERROR: cannot write ids file %s\n", ids_file);
+    exit(1);
+  }
+}
+
+/**
+ * ======== InitIdsCorpus ========
+ * Maps the ids file for '-ids <file>' into memory, first (re)writing it from
+ * the training text if it doesn't exist or was built for another vocabulary.
+ */
+void InitIdsCorpus() {
+  struct ids_header hdr, want;
+  struct stat st;
+  int fd, valid = 0;
+  void *map;
+  
+  memset(&want, 0, sizeof(want));
+  memcpy(want.magic, "W2VIDS1", 8);
+  want.vocab_size = vocab_size;
+  want.vocab_checksum = VocabChecksum();
+  
+  fd = open(ids_file, O_RDONLY);
+  if (fd >= 0) {
+    if ((read(fd, &hdr, sizeof(hdr)) == sizeof(hdr)) && !memcmp(hdr.magic, want.magic, 8) &&
+        (hdr.vocab_size == want.vocab_size) && (hdr.vocab_checksum == want.vocab_checksum) &&
+        (fstat(fd, &st) == 0) && (st.st_size == sizeof(hdr) + hdr.num_ids * (long long)sizeof(int)))
+      valid = 1;
+    if (!valid) close(fd);
+  }
+  if (!valid) {
+    if (debug_mode > 0) printf("Writing ids file %s\n", ids_file);
+    WriteIdsFile(&want);
+    hdr = want;
+    fd = open(ids_file, O_RDONLY);
+    if (fd < 0) {
+      printf("ERROR: cannot open ids file %s\n", ids_file);
+      exit(1);
+    }
+  } else if (debug_mode > 0) printf("Reusing ids file %s\n", ids_file);
+  
+  corpus_num_ids = hdr.num_ids;
+  // Map the header too, so the ids start at a page offset the kernel accepts.
+  map = mmap(NULL, sizeof(hdr) + corpus_num_ids * sizeof(int), PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    printf("ERROR: cannot map ids file %s\n", ids_file);
+    exit(1);
+  }
+  close(fd);
+  // The threads read the file front to back within their ranges.
+  madvise(map, sizeof(hdr) + corpus_num_ids * sizeof(int), MADV_SEQUENTIAL);
+  corpus_ids = (int *)((char *)map + sizeof(hdr));
+  if (debug_mode > 0) printf("Ids in corpus: %lld\n", corpus_num_ids);
+}
+
+/**
+ * ======== InitNuma ========
+ * Reads the NUMA node layout from sysfs into 'numa_cpus'. Only the CPUs this
+ * process is allowed to run on are kept, and nodes without any of them
+ * (e.g. memory-only nodes) are skipped.
+ */
+void InitNuma() {
+  char path[MAX_STRING * 2], list[4096], *p;
+  cpu_set_t allowed;
+  long long node, lo, hi, c;
+  FILE *f;
+  
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  num_numa_nodes = 0;
+  
+  // Node numbers can have gaps, so probe every possible one. There can't be
+  // more useful nodes than threads.
+  for (node = 0; node < 1024 && num_numa_nodes < MAX_NUMA_NODES && num_numa_nodes < num_threads; node++) {
+    sprintf(path, "/sys/devices/system/node/node%lld/cpulist", node);
+    f = fopen(path, "rb");
+    if (f == NULL) continue;
+    if (fgets(list, sizeof(list), f) == NULL) list[0] = 0;
+    fclose(f);
+    
+    // The list looks like "0-3,8-11".
+    CPU_ZERO(&numa_cpus[num_numa_nodes]);
+    for (p = list; *p >= '0' && *p <= '9'; ) {
+      lo = hi = strtoll(p, &p, 10);
+      if (*p == '-') hi = strtoll(p + 1, &p, 10);
+      for (c = lo; c <= hi && c < CPU_SETSIZE; c++)
+        if (CPU_ISSET(c, &allowed)) CPU_SET(c, &numa_cpus[num_numa_nodes]);
+      if (*p == ',') p++;
+    }
+    if (CPU_COUNT(&numa_cpus[num_numa_nodes]) > 0) num_numa_nodes++;
+  }
+  if (num_numa_nodes == 0) {
+    num_numa_nodes = 1;
+    numa_cpus[0] = allowed;
+  }
+  if (debug_mode > 0) {
+    printf("NUMA nodes: %d\n", num_numa_nodes);
+    for (node = 0; node < num_numa_nodes; node++)
+      printf("  node %lld: %d cpus\n", node, CPU_COUNT(&numa_cpus[node]));
+  }
+}
+
+// Returns the NUMA node that thread 'id' is assigned to. The threads are
+// split into one contiguous group per node.
+int ThreadNode(long long id) {
+  if (!numa) return 0;
+  return id * num_numa_nodes / num_threads;
+}
+
+// Pins the calling thread to the CPUs of its NUMA node.
+void PinThread(long long id) {
+  if (!numa) return;
+  sched_setaffinity(0, sizeof(cpu_set_t), &numa_cpus[ThreadNode(id)]);
+}
+
+/**
+ * ======== MergeReplicas ========
+ * Merges rows [start, end) of the syn1neg replicas. The change each replica
+ * has made since the last merge is added into syn1neg, and every replica is
+ * reset to the result. Summing the changes (rather than averaging the
+ * replicas) keeps the effective learning rate of the output layer the same
+ * as with a single shared copy.
+ *
+ * The threads call this on their own slices while the others keep training,
+ * in the same lock-free spirit as the rest of the training updates.
+ */
+void MergeReplicas(long long start, long long end) {
+  long long a, n;
+  real s;
+  
+  for (a = start * layer1_size; a < end * layer1_size; a++) {
+    s = syn1neg[a];
+    for (n = 0; n < num_numa_nodes; n++) s += syn1neg_replicas[n][a] - syn1neg[a];
+    syn1neg[a] = s;
+    for (n = 0; n < num_numa_nodes; n++) syn1neg_replicas[n][a] = s;
+  }
+}
+
+/**
+ * ======== LcgSkip ========
+ * Returns the state of the linear congruential generator
+ *   x = x * 25214903917 + 11
+ * after 'n' steps from 'x', in O(log n) time. This lets the threads in
+ * InitNetThread each start in the middle of the random sequence.
+ */
+unsigned long long LcgSkip(unsigned long long x, unsigned long long n) {
+  unsigned long long mul = 25214903917ULL, add = 11, acc_mul = 1, acc_add = 0;
+  
+  while (n) {
+    if (n & 1) {
+      acc_mul *= mul;
+      acc_add = acc_add * mul + add;
+    }
+    add = (mul + 1) * add;
+    mul *= mul;
+    n >>= 1;
+  }
+  return acc_mul * x + acc_add;
+}
+
+/**
+ * ======== TouchRow ========
+ * Marks a row of syn0, syn1 or syn1neg as changed since this worker's last
+ * sync (see "Workers"). Does nothing when not running as a worker.
+ *
+ * Rows are marked after they are written, so that an update which races
+ * with a sync is either included in it or marks the row again.
+ */
+static inline void TouchRow(unsigned char *touched, long long row) {
+  if ((touched != NULL) && !touched[row]) touched[row] = 1;
+}
+
+/**
+ * ======== SyncWorkerRow ========
+ * Syncs one row of a worker's copy 'local' of weight matrix 'k' (0 = syn0,
+ * 1 = syn1, 2 = syn1neg) with the master copy. If the worker changed the
+ * row, its change since the last sync (local - base) is added into the
+ * master row. If the master row has changed since the worker last saw it
+ * (its version is newer), the worker takes the master row, which includes
+ * the other workers' changes. Rows which nobody changed are skipped without
+ * taking the lock.
+ *
+ * The worker's other threads keep training while it syncs, so 'local' may
+ * change under us. Each value is read once ('snap'), the delta is taken
+ * from that, and whatever was written since is kept on top of the master
+ * value: local = master + (local - snap). Without that, a concurrent update
+ * to the row would be overwritten and lost.
+ *
+ * The hot rows of syn0 and syn1neg are merged from the threads' own copies
+ * without being marked, so they are always sent.
+ * Returns 1 if the row was sent.
+ */
+int SyncWorkerRow(int k, real *local, unsigned char *touched, long long row) {
+  long long c, l = row * layer1_size;
+  real *base = worker_base[k], *master = worker_master[k], snap, m;
+  volatile real *v = local + l;
+  int send = touched[row] || ((k != 1) && (row < hot_words));
+  
+  if (!send && (__atomic_load_n(&worker_version[k][row], __ATOMIC_ACQUIRE) == worker_seen[k][row])) return 0;
+  pthread_mutex_lock(&worker_shared->locks[row % WORKER_ROW_LOCKS]);
+  // Clear the mark before reading the row, so a later update marks it again.
+  if (send) touched[row] = 0;
+  for (c = 0; c < layer1_size; c++) {
+    snap = v[c];
+    if (send) master[l + c] += snap - base[l + c];
+    m = master[l + c];
+    // Rows which weren't sent may still hold an update since the last sync,
+    // so keep (local - base) rather than (local - snap) for them.
+    v[c] = m + (v[c] - (send ? snap : base[l + c]));
+    base[l + c] = m;
+  }
+  if (send) __atomic_add_fetch(&worker_version[k][row], 1, __ATOMIC_RELEASE);
+  worker_seen[k][row] = worker_version[k][row];
+  pthread_mutex_unlock(&worker_shared->locks[row % WORKER_ROW_LOCKS]);
+  return send;
+}
+
+/**
+ * ======== SyncWorkerRows ========
+ * Syncs rows [start, end) of this worker's weights with the master copy.
+ * Like MergeReplicas, each training thread syncs its own slice of the rows,
+ * while the other threads keep training.
+ */
+void SyncWorkerRows(long long start, long long end) {
+  long long a, sent = 0, synced = 0;
+  
+  for (a = start; a < end; a++) {
+    sent += SyncWorkerRow(0, syn0, syn0_touched, a);
+    synced++;
+    if (hs) {
+      sent += SyncWorkerRow(1, syn1, syn1_touched, a);
+      synced++;
+    }
+    if (negative > 0) {
+      sent += SyncWorkerRow(2, syn1neg, syn1neg_touched, a);
+      synced++;
+    }
+  }
+  __atomic_add_fetch(&worker_shared->rows_sent, sent, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&worker_shared->rows_synced, synced, __ATOMIC_RELAXED);
+}
+
+// Allocates a shared, anonymous mapping which survives fork().
+void *AllocShared(long long size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  return p;
+}
+
+/**
+ * ======== StartWorkers ========
+ * Called once the vocabulary and the initial weights are ready. Copies the
+ * weights into shared memory as the master copy, then forks the workers.
+ * Returns in each worker, with 'worker_id' set, to go on with training; and
+ * in the coordinator, which trains nothing itself (see FinishWorkers).
+ */
+void StartWorkers() {
+  long long a, n = (long long)vocab_size * layer1_size;
+  pthread_mutexattr_t attr;
+  real *layers[3] = {syn0, hs ? syn1 : NULL, (negative > 0) ? syn1neg : NULL};
+  
+  worker_shared = (struct worker_shared *)AllocShared(sizeof(struct worker_shared) +
+                                                      workers * num_threads * sizeof(long long));
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  for (a = 0; a < WORKER_ROW_LOCKS; a++) pthread_mutex_init(&worker_shared->locks[a], &attr);
+  for (a = 0; a < 3; a++) if (layers[a] != NULL) {
+    worker_master[a] = (real *)AllocShared(n * sizeof(real));
+    memcpy(worker_master[a], layers[a], n * sizeof(real));
+    worker_version[a] = (unsigned int *)AllocShared(vocab_size * sizeof(unsigned int));
+  }
+  
+  fflush(stdout);
+  for (a = 0; a < workers; a++) {
+    worker_pids[a] = fork();
+    if (worker_pids[a] < 0) {
+      printf("ERROR: fork failed\n");
+      exit(1);
+    }
+    if (worker_pids[a] == 0) {
+      worker_id = a;
+      // Only the first worker reports progress.
+      if (worker_id > 0) debug_mode = 0;
+      for (a = 0; a < 3; a++) if (layers[a] != NULL) {
+        worker_base[a] = (real *)malloc(n * sizeof(real));
+        if (worker_base[a] == NULL) {printf("Memory allocation failed\n"); exit(1);}
+        memcpy(worker_base[a], layers[a], n * sizeof(real));
+        worker_seen[a] = (unsigned int *)calloc(vocab_size, sizeof(unsigned int));
+      }
+      syn0_touched = (unsigned char *)calloc(vocab_size, 1);
+      if (hs) syn1_touched = (unsigned char *)calloc(vocab_size, 1);
+      if (negative > 0) syn1neg_touched = (unsigned char *)calloc(vocab_size, 1);
+      return;
+    }
+  }
+}
+
+/**
+ * ======== FinishWorkers ========
+ * Run by the coordinator. Waits for all of the workers, then takes the
+ * master weights as the result of training.
+ */
+void FinishWorkers() {
+  long long a, n = (long long)vocab_size * layer1_size;
+  int status;
+  
+  for (a = 0; a < workers; a++) {
+    waitpid(worker_pids[a], &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      printf("ERROR: worker %lld failed\n", a);
+      exit(1);
+    }
+  }
+  memcpy(syn0, worker_master[0], n * sizeof(real));
+  if (hs) memcpy(syn1, worker_master[1], n * sizeof(real));
+  if (negative > 0) memcpy(syn1neg, worker_master[2], n * sizeof(real));
+  if (debug_mode > 0)
+    printf("Worker sync: sent %lld of %lld rows (%.1f%%)\n", worker_shared->rows_sent, worker_shared->rows_synced,
+           100.0 * worker_shared->rows_sent / (worker_shared->rows_synced + 1e-9));
+}
+
+/**
+ * ======== InitNetThread ========
+ * Initializes one thread's share of the weight matrices. Since the thread
+ * is the first to touch these pages, they end up on its NUMA node.
+ *
+ * syn0, syn1 and syn1neg are split evenly over all of the threads. A
+ * per-node syn1neg replica is split over the threads of its node only.
+ */
+void *InitNetThread(void *id) {
+  long long a, b, start, end, first, count, node;
+  unsigned long long next_random;
+  real *row = (real *)malloc(layer1_size * sizeof(real));
+  
+  PinThread((long long)id);
+  start = vocab_size * (long long)id / num_threads;
+  end = vocab_size * ((long long)id + 1) / num_threads;
+  
+  if (hs) for (a = start; a < end; a++) for (b = 0; b < layer1_size; b++)
+   syn1[a * layer1_size + b] = 0;
+  
+  if (bf16 && (negative > 0)) memset(syn1neg_bf16 + start * layer1_size, 0, (end - start) * layer1_size * sizeof(unsigned short));
+  else if (negative > 0) {
+    memset(syn1neg + start * layer1_size, 0, (end - start) * layer1_size * sizeof(real));
+    
+    // Zero this thread's share of its node's replica. The replica is split
+    // over the node's threads only.
+    if (numa > 1) {
+      node = ThreadNode((long long)id);
+      for (first = 0; ThreadNode(first) != node; first++) {}
+      for (count = 0; first + count < num_threads && ThreadNode(first + count) == node; count++) {}
+      a = vocab_size * ((long long)id - first) / count;
+      b = vocab_size * ((long long)id - first + 1) / count;
+      memset(syn1neg_replicas[node] + a * layer1_size, 0, (b - a) * layer1_size * sizeof(real));
+    }
+  }
+  
+  // Randomly initialize the weights for the hidden layer (word vector layer).
+  // TODO - What's the equation here?
+  //
+  // Element i of syn0 uses the (i + 1)th number from the generator seeded
+  // with '-seed', so the result is the same for any number of threads.
+  next_random = LcgSkip(seed, start * layer1_size);
+  for (a = start; a < end; a++) {
+    for (b = 0; b < layer1_size; b++) {
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      row[b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
+    }
+    if (bf16) FloatToBf16Nearest(syn0_bf16 + a * layer1_size, row, layer1_size);
+    else memcpy(syn0 + a * layer1_size, row, layer1_size * sizeof(real));
+  }
+  free(row);
+  pthread_exit(NULL);
+}
+
+/**
+ * ======== InitNet ========
+ * Allocates the weight matrices, then initializes them in parallel with
+ * InitNetThread.
+ */
+void InitNet() {
+  long long a, n;
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  
+  // Allocate the hidden layer of the network, which is what becomes the word vectors.
+  // The variable for this layer is 'syn0'.
+  if (bf16) {
+    InitNoiseTable();
+    syn0_bf16 = (unsigned short *)AllocWeights((long long)vocab_size * layer1_size * sizeof(unsigned short));
+    if (syn0_bf16 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  } else {
+    syn0 = (real *)AllocWeights((long long)vocab_size * layer1_size * sizeof(real));
+    if (syn0 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  }
+  
+  // If we're using hierarchical softmax for training...
+  if (hs) {
+    syn1 = (real *)AllocWeights((long long)vocab_size * layer1_size * sizeof(real));
+    if (syn1 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  }
+  
+  // If we're using negative sampling for training...
+  if (negative>0) {
+    // Allocate the output layer of the network. 
+    // The variable for this layer is 'syn1neg'.
+    // This layer has the same size as the hidden layer, but is the transpose.
+    // All of the weights in the output layer start at 0.
+    if (bf16) {
+      syn1neg_bf16 = (unsigned short *)AllocWeights((long long)vocab_size * layer1_size * sizeof(unsigned short));
+      if (syn1neg_bf16 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    } else {
+      syn1neg = (real *)AllocWeights((long long)vocab_size * layer1_size * sizeof(real));
+      if (syn1neg == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    }
+    
+    // With '-numa 2' every node gets a replica too.
+    if (numa > 1) for (n = 0; n < num_numa_nodes; n++) {
+      syn1neg_replicas[n] = (real *)AllocWeights((long long)vocab_size * layer1_size * sizeof(real));
+      if (syn1neg_replicas[n] == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    }
+  }
+  
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, InitNetThread, (void *)a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  free(pt);
+  
+  // Create a binary tree for Huffman coding. This is only used for
+  // hierarchical softmax training.
+  if (hs) CreateBinaryTree();
+}
+
+// Returns the time in seconds from a monotonic clock.
+double WallTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * ======== Streaming Input ========
+ * When the training data is '-' (stdin) or a named pipe, it can't be split
+ * into chunks or read more than once. Instead, StreamReaderThread reads it
+ * front to back, converts it to vocab ids, and hands it to the training
+ * threads in batches of sentences. There is a single pass over the data,
+ * and the vocabulary must come from '-read-vocab'.
+ *
+ * Compressed files which can't be split into enough chunks (zstd, or gzip
+ * with few members; see "Compressed Input") are streamed the same way,
+ * except that the file is read again for each of the 'iter' passes.
+ *
+ * A batch is an array of ids ending on a sentence boundary, like a work
+ * chunk with '-ids'. There is a fixed pool of STREAM_BATCHES batches, which
+ * move between two bounded queues: 'stream_free' (empty, for the reader to
+ * fill) and 'stream_full' (for the training threads). So the reader blocks
+ * when the training threads fall behind, and at most STREAM_BATCHES *
+ * STREAM_BATCH_SIZE ids are held in memory.
+ */
+#define STREAM_BATCH_SIZE (1 << 16)
+#define STREAM_BATCHES 64
+struct stream_batch {
+  int *ids;
+  long long len;
+};
+
+struct stream_queue {
+  struct stream_batch *items[STREAM_BATCHES];
+  int head, count, closed;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+struct stream_queue stream_free, stream_full;
+pthread_t stream_reader;
+
+// Adds a batch to the back of queue 'q'. The queues can hold every batch,
+// so this never has to wait.
+void StreamPush(struct stream_queue *q, struct stream_batch *b) {
+  pthread_mutex_lock(&q->mutex);
+  q->items[(q->head + q->count) % STREAM_BATCHES] = b;
+  q->count++;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->mutex);
+}
+
+// Takes the batch at the front of queue 'q', waiting for one if necessary.
+// Returns NULL once the queue is empty and closed.
+struct stream_batch *StreamPop(struct stream_queue *q) {
+  struct stream_batch *b = NULL;
+  pthread_mutex_lock(&q->mutex);
+  while ((q->count == 0) && !q->closed) pthread_cond_wait(&q->cond, &q->mutex);
+  if (q->count > 0) {
+    b = q->items[q->head];
+    q->head = (q->head + 1) % STREAM_BATCHES;
+    q->count--;
+  }
+  pthread_mutex_unlock(&q->mutex);
+  return b;
+}
+
+// Marks queue 'q' as closed: once it is empty, StreamPop returns NULL.
+void StreamClose(struct stream_queue *q) {
+  pthread_mutex_lock(&q->mutex);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->mutex);
+}
+
+/**
+ * ======== StreamReaderThread ========
+ * Reads the training data, and fills batches with the ids of the words
+ * which are in the vocabulary. A batch is handed off after the first end of
+ * sentence once it is nearly full (or when it is full, for a sentence which
+ * doesn't fit).
+ */
+void *StreamReaderThread(void *arg) {
+  long long word, pass;
+  struct stream_batch *b = NULL;
+  struct text_reader *fi;
+  
+  for (pass = 0; pass < iter; pass++) {
+    fi = OpenReader(train_file);
+    if (fi == NULL) {
+      printf("ERROR: training data file not found!\n");
+      exit(1);
+    }
+    while (1) {
+      word = ReadWordIndex(fi);
+      if (fi->eof) break;
+      if (word == -1) continue;
+      if (b == NULL) {
+        b = StreamPop(&stream_free);
+        b->len = 0;
+      }
+      b->ids[b->len++] = word;
+      if ((b->len == STREAM_BATCH_SIZE) || ((word == 0) && (b->len > STREAM_BATCH_SIZE - MAX_SENTENCE_LENGTH))) {
+        StreamPush(&stream_full, b);
+        b = NULL;
+      }
+    }
+    CloseReader(fi);
+  }
+  if (b != NULL) StreamPush(&stream_full, b);
+  StreamClose(&stream_full);
+  return NULL;
+}
+
+/**
+ * ======== StartStream ========
+ * Sets up the batch queues and starts StreamReaderThread.
+ */
+void StartStream() {
+  long long a;
+  
+  pthread_mutex_init(&stream_free.mutex, NULL);
+  pthread_cond_init(&stream_free.cond, NULL);
+  pthread_mutex_init(&stream_full.mutex, NULL);
+  pthread_cond_init(&stream_full.cond, NULL);
+  for (a = 0; a < STREAM_BATCHES; a++) {
+    struct stream_batch *b = (struct stream_batch *)malloc(sizeof(struct stream_batch));
+    b->ids = (int *)malloc(STREAM_BATCH_SIZE * sizeof(int));
+    if (b->ids == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    StreamPush(&stream_free, b);
+  }
+  pthread_create(&stream_reader, NULL, StreamReaderThread, NULL);
+}
+
+/**
+ * ======== InitWorkChunks ========
+ * Splits the training data into sentence-aligned chunks, and hands each
+ * thread an equal share of the 'iter' passes over them.
+ *
+ * There are about 16 chunks per thread, so that a thread which finishes its
+ * share early has something to steal, but chunks are kept between 64K and
+ * 8M words (or bytes) to bound the per-chunk overhead and the imbalance at
+ * the very end of training.
+ *
+ * In gzip data, a chunk can only start at the beginning of a member (plus
+ * the few bytes to the next sentence), since that's where inflating can
+ * start. Chunks are rounded up to whole members, so the number of chunks is
+ * limited by the number of members.
+ */
+void InitWorkChunks() {
+  long long a, size, chunk, pos, next, max_chunks, total, first;
+  struct text_reader *fi = NULL;
+  
+  // Streamed data isn't split into chunks; see "Streaming Input".
+  size = (corpus_ids != NULL) ? corpus_num_ids : file_size;
+  if (stream) size = 0;
+  chunk = size / (num_threads * 16);
+  if (chunk < (1 << 16)) chunk = 1 << 16;
+  if (chunk > (8 << 20)) chunk = 8 << 20;
+  max_chunks = size / chunk + 2;
+  work_chunks = (struct work_chunk *)malloc(max_chunks * sizeof(struct work_chunk));
+  if ((corpus_ids == NULL) && !stream) {
+    fi = OpenReader(train_file);
+    if (fi == NULL) {
+      printf("ERROR: training data file not found!\n");
+      exit(1);
+    }
+  }
+  
+  num_work_chunks = 0;
+  pos = 0;
+  while (pos < size) {
+    next = -1;
+    if (pos + chunk < size) {
+      if (corpus_ids != NULL) {
+        // End the chunk after the next </s>, if there is one close by.
+        for (next = pos + chunk; (next < size) && (next < pos + 2 * chunk); next++)
+          if (corpus_ids[next] == 0) break;
+        next++;
+      } else if (fi->z != NULL) {
+        next = NextMemberStart(pos + chunk);
+        if (next >= 0) next = FindSentenceStart(fi, next);
+      } else next = FindSentenceStart(fi, pos + chunk);
+    }
+    if ((next < 0) || (next > size)) next = size;
+    work_chunks[num_work_chunks].start = pos;
+    work_chunks[num_work_chunks].end = next;
+    num_work_chunks++;
+    pos = next;
+  }
+  if (fi != NULL) CloseReader(fi);
+  
+  // A worker process only trains its own shard of the chunks (see "Workers").
+  if (worker_id >= 0) {
+    first = num_work_chunks * worker_id / workers;
+    num_work_chunks = num_work_chunks * (worker_id + 1) / workers - first;
+    memmove(work_chunks, work_chunks + first, num_work_chunks * sizeof(struct work_chunk));
+  }
+  
+  total = iter * num_work_chunks;
+  if (posix_memalign((void **)&task_queues, 64, num_threads * sizeof(struct task_queue))) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < num_threads; a++)
+    task_queues[a].range = ((unsigned long long)(total * a / num_threads) << 32) |
+                           (unsigned long long)(total * (a + 1) / num_threads);
+  if (posix_memalign((void **)&thread_stats, 64, num_threads * sizeof(struct thread_stats))) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  memset(thread_stats, 0, num_threads * sizeof(struct thread_stats));
+  if ((debug_mode > 0) && !stream) printf("Work chunks: %lld\n", num_work_chunks);
+}
+
+/**
+ * ======== PopTask ========
+ * Takes one task from the front (owner) or the back (thief) of a queue.
+ * Returns -1 if the queue is empty.
+ */
+long long PopTask(struct task_queue *q, int from_back) {
+  unsigned long long old, next, end;
+  while (1) {
+    old = q->range;
+    next = old >> 32;
+    end = old & 0xFFFFFFFFULL;
+    if (next >= end) return -1;
+    if (from_back) {
+      if (__sync_bool_compare_and_swap(&q->range, old, (next << 32) | (end - 1))) return end - 1;
+    } else {
+      if (__sync_bool_compare_and_swap(&q->range, old, ((next + 1) << 32) | end)) return next;
+    }
+  }
+}
+
+/**
+ * ======== ClaimTask ========
+ * Returns the next task for thread 'id': its own next task if it has one,
+ * otherwise one stolen from another thread. Returns -1 when there is no
+ * work left anywhere.
+ */
+long long ClaimTask(long long id) {
+  long long k, t;
+  t = PopTask(&task_queues[id], 0);
+  if (t < 0) for (k = 1; k < num_threads; k++) {
+    t = PopTask(&task_queues[(id + k) % num_threads], 1);
+    if (t >= 0) {
+      thread_stats[id].stolen++;
+      break;
+    }
+  }
+  if (t >= 0) thread_stats[id].chunks++;
+  return t;
+}
+
+/**
+ * ======== WordCountActual ========
+ * Returns the number of training words processed so far by all threads.
+ *
+ * The per-thread counters are read without locking. Each one only ever
+ * grows, so the sum seen by a given thread never goes backwards either.
+ */
+long long WordCountActual() {
+  long long a, sum = 0;
+  if (workers > 0) {
+    for (a = 0; a < workers * num_threads; a++) sum += __atomic_load_n(&worker_shared->words[a], __ATOMIC_RELAXED);
+    return sum;
+  }
+  for (a = 0; a < num_threads; a++) sum += __atomic_load_n(&thread_stats[a].words, __ATOMIC_RELAXED);
+  return sum;
+}
+
+/*
+ * ======== Checkpoints ========
+ * With '-checkpoint <file>', the main thread writes a snapshot of the
+ * training state to <file> every 'checkpoint_interval' seconds, and
+ * '-resume <file>' continues training from such a snapshot. A snapshot holds
+ * the vocabulary, syn0, syn1 and/or syn1neg, the task queues, and each
+ * thread's position, word count, alpha and random number state.
+ *
+ * To take one, the main thread sets 'checkpoint_requested'. Each training
+ * thread notices it at its next sentence boundary, merges its private rows,
+ * records its state in 'thread_states' and waits (PauseForCheckpoint). Once
+ * all of the running threads are paused, the main thread fork()s. The child
+ * gets a copy-on-write view of memory and writes it out (WriteCheckpoint),
+ * while the parent lets the threads continue right away, so training only
+ * stops for as long as the fork takes.
+ *
+ * The file is written to <file>.tmp and renamed when complete, so a crash
+ * never leaves a partial checkpoint behind. Note that with '-hugepages 2'
+ * each page training touches while the child is writing needs a spare page
+ * in the hugetlbfs pool; if there are none, the child is killed and that
+ * checkpoint is lost.
+ */
+struct checkpoint_header {
+  char magic[8];
+  long long vocab_size, layer1_size, hs, negative, bf16, iter, num_threads;
+  long long num_work_chunks, train_words, count_words, file_size;
+};
+
+struct thread_state {
+  long long chunk_pos, chunk_end, word_count, last_word_count;
+  real alpha;
+  struct rng_buffer rng;
+};
+
+char checkpoint_file[MAX_STRING], resume_file[MAX_STRING];
+long long checkpoint_interval = 1800;
+struct thread_state *thread_states;
+pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpoint_cond;
+int checkpoint_requested = 0, threads_running = 0, threads_paused = 0;
+pid_t checkpoint_pid = 0;
+long long resume_offset = 0;
+const char checkpoint_magic[8] = {'W', '2', 'V', 'C', 'K', 'P', 'T', '1'};
+
+/**
+ * ======== WriteCheckpoint ========
+ * Writes the training state to 'file'. Runs in the child process forked by
+ * TakeCheckpoint, or at the end of training for '-save-model'. Returns 0 on
+ * success.
+ */
+int WriteCheckpoint(char *file) {
+  long long a, n = (long long)vocab_size * layer1_size;
+  int len, ok;
+  char tmp_file[MAX_STRING + 8];
+  struct checkpoint_header hdr;
+  
+  // The replicas only exist in this process's copy of memory now, so they
+  // can be folded into syn1neg without disturbing training.
+  if ((numa > 1) && (negative > 0)) MergeReplicas(0, vocab_size);
+  
+  sprintf(tmp_file, "%s.tmp", file);
+  FILE *fo = fopen(tmp_file, "wb");
+  if (fo == NULL) return 1;
+  setvbuf(fo, NULL, _IOFBF, 1 << 22);
+  
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, checkpoint_magic, 8);
+  hdr.vocab_size = vocab_size;
+  hdr.layer1_size = layer1_size;
+  hdr.hs = hs;
+  hdr.negative = negative;
+  hdr.bf16 = bf16;
+  hdr.iter = iter;
+  hdr.num_threads = num_threads;
+  hdr.num_work_chunks = num_work_chunks;
+  hdr.train_words = train_words;
+  hdr.count_words = count_words;
+  hdr.file_size = file_size;
+  fwrite(&hdr, sizeof(hdr), 1, fo);
+  for (a = 0; a < vocab_size; a++) {
+    len = strlen(VocabWord(a));
+    fwrite(&vocab_cn[a], sizeof(long long), 1, fo);
+    fwrite(&len, sizeof(int), 1, fo);
+    fwrite(VocabWord(a), 1, len, fo);
+  }
+  
+  if (bf16) fwrite(syn0_bf16, sizeof(unsigned short), n, fo);
+  else fwrite(syn0, sizeof(real), n, fo);
+  if (hs) fwrite(syn1, sizeof(real), n, fo);
+  if (negative > 0) {
+    if (bf16) fwrite(syn1neg_bf16, sizeof(unsigned short), n, fo);
+    else fwrite(syn1neg, sizeof(real), n, fo);
+  }
+  for (a = 0; a < num_threads; a++) fwrite(&task_queues[a].range, sizeof(unsigned long long), 1, fo);
+  fwrite(thread_states, sizeof(struct thread_state), num_threads, fo);
+  
+  ok = (fflush(fo) == 0) && !ferror(fo) && (fsync(fileno(fo)) == 0);
+  if ((fclose(fo) != 0) || !ok) return 1;
+  return rename(tmp_file, file) != 0;
+}
+
+/**
+ * ======== PauseForCheckpoint ========
+ * Called by a training thread which has seen 'checkpoint_requested' and
+ * recorded its state. Waits until the snapshot has been taken.
+ */
+void PauseForCheckpoint() {
+  pthread_mutex_lock(&checkpoint_mutex);
+  threads_paused++;
+  pthread_cond_broadcast(&checkpoint_cond);
+  while (checkpoint_requested) pthread_cond_wait(&checkpoint_cond, &checkpoint_mutex);
+  threads_paused--;
+  pthread_mutex_unlock(&checkpoint_mutex);
+}
+
+/**
+ * ======== TakeCheckpoint ========
+ * Pauses the training threads, forks a child to write the checkpoint, and
+ * lets them continue. The previous child is waited for first, so at most
+ * one checkpoint is being written at a time.
+ */
+void TakeCheckpoint() {
+  int status;
+  double t;
+  
+  if (checkpoint_pid > 0) {
+    waitpid(checkpoint_pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) printf("\nWARNING: writing checkpoint %s failed\n", checkpoint_file);
+  }
+  
+  t = WallTime();
+  pthread_mutex_lock(&checkpoint_mutex);
+  __atomic_store_n(&checkpoint_requested, 1, __ATOMIC_RELEASE);
+  while (threads_paused < threads_running) pthread_cond_wait(&checkpoint_cond, &checkpoint_mutex);
+  
+  // The training threads are all waiting on the condition variable, so none
+  // of them holds a lock (in malloc or stdio, say) that the child could need.
+  fflush(stdout);
+  checkpoint_pid = fork();
+  if (checkpoint_pid == 0) _exit(WriteCheckpoint(checkpoint_file));
+  
+  __atomic_store_n(&checkpoint_requested, 0, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&checkpoint_cond);
+  pthread_mutex_unlock(&checkpoint_mutex);
+  
+  if (checkpoint_pid < 0) printf("\nWARNING: fork failed, checkpoint skipped\n");
+  else if (debug_mode > 0) printf("\nCheckpoint %s: training paused %.3fs\n", checkpoint_file, WallTime() - t);
+}
+
+/**
+ * ======== WaitForTraining ========
+ * Run by the main thread while the training threads work. Takes a
+ * checkpoint every 'checkpoint_interval' seconds until they have all
+ * finished, then waits for the last checkpoint to be written.
+ */
+void WaitForTraining() {
+  struct timespec ts;
+  int status;
+  double next = WallTime() + checkpoint_interval;
+  
+  pthread_mutex_lock(&checkpoint_mutex);
+  while (threads_running > 0) {
+    ts.tv_sec = (time_t)next;
+    ts.tv_nsec = (long)((next - ts.tv_sec) * 1e9);
+    pthread_cond_timedwait(&checkpoint_cond, &checkpoint_mutex, &ts);
+    if ((threads_running > 0) && (WallTime() >= next)) {
+      pthread_mutex_unlock(&checkpoint_mutex);
+      TakeCheckpoint();
+      pthread_mutex_lock(&checkpoint_mutex);
+      next = WallTime() + checkpoint_interval;
+    }
+  }
+  pthread_mutex_unlock(&checkpoint_mutex);
+  if (checkpoint_pid > 0) {
+    waitpid(checkpoint_pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) printf("\nWARNING: writing checkpoint %s failed\n", checkpoint_file);
+  }
+}
+
+// Exits if option 'name' of the checkpoint doesn't match this run's.
+void CheckResumeOption(char *name, long long saved, long long value) {
+  if (saved == value) return;
+  printf("ERROR: %s was written with %s %lld, not %lld\n", resume_file, name, saved, value);
+  exit(1);
+}
+
+/**
+ * ======== ResumeVocab ========
+ * Loads the vocabulary from 'resume_file', in place of
+ * LearnVocabFromTrainFile. The words are already sorted and reduced, so
+ * they are added in order without calling SortVocab.
+ */
+// Opens checkpoint 'file' and reads its header, or exits.
+FILE *OpenCheckpoint(char *file, struct checkpoint_header *hdr) {
+  FILE *fin = fopen(file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: checkpoint file %s not found!\n", file);
+    exit(1);
+  }
+  if ((fread(hdr, sizeof(struct checkpoint_header), 1, fin) != 1) || memcmp(hdr->magic, checkpoint_magic, 8)) {
+    printf("ERROR: %s is not a checkpoint\n", file);
+    exit(1);
+  }
+  return fin;
+}
+
+// Reads the next vocab word of checkpoint 'file' into 'word' and its count
+// into 'cn', or exits.
+void ReadCheckpointWord(FILE *fin, char *file, char *word, long long *cn) {
+  int len;
+  if ((fread(cn, sizeof(long long), 1, fin) != 1) || (fread(&len, sizeof(int), 1, fin) != 1) ||
+      (len < 0) || (len >= MAX_STRING) || (fread(word, 1, len, fin) != len)) {
+    printf("ERROR: %s is truncated\n", file);
     exit(1);
   }
+  word[len] = 0;
+}
+
+void ResumeVocab() {
+  long long a, i, cn;
+  char word[MAX_STRING];
+  struct checkpoint_header hdr;
+  FILE *fin = OpenCheckpoint(resume_file, &hdr);
+  CheckResumeOption((char *)"-size", hdr.layer1_size, layer1_size);
+  CheckResumeOption((char *)"-hs", hdr.hs, hs);
+  CheckResumeOption((char *)"-negative", hdr.negative, negative);
+  CheckResumeOption((char *)"-bf16", hdr.bf16, bf16);
+  CheckResumeOption((char *)"-iter", hdr.iter, iter);
+  CheckResumeOption((char *)"-threads", hdr.num_threads, num_threads);
   
+  InitVocabHash(0);
   vocab_size = 0;
-  
-  // The special token </s> is used to mark the end of a sentence. In training,
-  // the context window does not go beyond the ends of a sentence.
-  // 
-  // Add </s> explicitly here so that it occurs at position 0 in the vocab. 
-  AddWordToVocab((char *)"</s>");
-  
-  while (1) {
-    // Read the next word from the file into the string 'word'.
-    ReadWord(word, fin);
-    
-    // Stop when we've reached the end of the file.
-    if (feof(fin)) break;
-    
-    // Count the total number of tokens in the training text.
-    train_words++;
-    
-    // Print progress at every 100,000 words.
-    if ((debug_mode > 1) && (train_words % 100000 == 0)) {
-      printf("%lldK%c", train_words / 1000, 13);
-      fflush(stdout);
-    }
-    
-    // Look up this word in the vocab to see if we've already added it.
-    i = SearchVocab(word);
-    
-    // If it's not in the vocab...
-    if (i == -1) {
-      // ...add it.
-      a = AddWordToVocab(word);
-      
-      // Initialize the word frequency to 1.
-      vocab[a].cn = 1;
-    
-    // If it's already in the vocab, just increment the word count.
-    } else vocab[i].cn++;
-    
-    // If the vocabulary has grown too large, trim out the most infrequent 
-    // words. The vocabulary is considered "too large" when it's filled more
-    // than 70% of the hash table (this is to try and keep hash collisions
-    // down).
-    if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
+  for (a = 0; a < hdr.vocab_size; a++) {
+    ReadCheckpointWord(fin, resume_file, word, &cn);
+    i = AddWordToVocab(word);
+    vocab_cn[i] = cn;
   }
-  
-  // Sort the vocabulary in descending order by number of word occurrences.
-  // Remove (and free the associated memory) for all the words that occur
-  // fewer than 'min_count' times.
-  SortVocab();
-  
-  // Report the final vocabulary size, and the total number of words 
-  // (excluding those filtered from the vocabulary) in the training set.
+  train_words = hdr.train_words;
+  count_words = hdr.count_words;
+  file_size = hdr.file_size;
+  if (train_format == READER_GZIP) IndexTrainFile();
+  resume_offset = ftell(fin);
+  fclose(fin);
   if (debug_mode > 0) {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
   }
+}
+
+/**
+ * ======== ResumeTraining ========
+ * Loads the rest of 'resume_file' (the weights, the task queues and the
+ * thread states) once InitNet and InitWorkChunks have set everything up.
+ */
+void ResumeTraining() {
+  long long a, n = (long long)vocab_size * layer1_size, got = n;
+  struct checkpoint_header hdr;
+  FILE *fin = OpenCheckpoint(resume_file, &hdr);
   
-  file_size = ftell(fin);
+  CheckResumeOption((char *)"work chunks", hdr.num_work_chunks, num_work_chunks);
+  fseek(fin, resume_offset, SEEK_SET);
+  
+  if (bf16) got = fread(syn0_bf16, sizeof(unsigned short), n, fin);
+  else got = fread(syn0, sizeof(real), n, fin);
+  if (hs && (got == n)) got = fread(syn1, sizeof(real), n, fin);
+  if ((negative > 0) && (got == n)) {
+    if (bf16) got = fread(syn1neg_bf16, sizeof(unsigned short), n, fin);
+    else got = fread(syn1neg, sizeof(real), n, fin);
+  }
+  for (a = 0; (a < num_threads) && (got == n); a++)
+    if (fread(&task_queues[a].range, sizeof(unsigned long long), 1, fin) != 1) got = -1;
+  if ((got != n) || (fread(thread_states, sizeof(struct thread_state), num_threads, fin) != num_threads)) {
+    printf("ERROR: %s is truncated\n", resume_file);
+    exit(1);
+  }
   fclose(fin);
+  
+  if ((numa > 1) && (negative > 0))
+    for (a = 0; a < num_numa_nodes; a++) memcpy(syn1neg_replicas[a], syn1neg, n * sizeof(real));
+  for (a = 0; a < num_threads; a++) thread_stats[a].words = thread_states[a].word_count;
+  if (debug_mode > 0) printf("Resuming from %s at %lld words\n", resume_file, WordCountActual());
 }
 
-void SaveVocab() {
-  long long i;
-  FILE *fo = fopen(save_vocab_file, "wb");
-  for (i = 0; i < vocab_size; i++) fprintf(fo, "%s %lld\n", vocab[i].word, vocab[i].cn);
-  fclose(fo);
+/*
+ * ======== Incremental Training ========
+ * '-save-model <file>' writes the finished model in the checkpoint format,
+ * which keeps syn1neg and the word counts alongside the word vectors.
+ * '-init-model <file>' starts a new run from such a model (or from any
+ * checkpoint) instead of from scratch, and trains it on just the new data
+ * given by '-train':
+ *
+ *   1. The new data is counted as usual (LearnVocabFromTrainFile), and
+ *      MergeModelVocab adds those counts to the model's. Words which are new
+ *      need 'min_count' occurrences in the new data; the model's words are
+ *      all kept. The merged vocabulary is sorted again, so a word's id may
+ *      change, and 'init_model_ids' records where each model word went.
+ *   2. InitNet sets up the weights as usual, which gives the new words
+ *      random vectors, and LoadModelWeights then copies the model's syn0 and
+ *      syn1neg rows into place.
+ *   3. The unigram table (or alias table) and the Huffman tree are built
+ *      from the merged counts as usual.
+ *
+ * The Huffman tree is rebuilt from the merged counts, so its inner nodes
+ * don't line up with the model's, and syn1 starts over from zero.
+ *
+ * Subsampling uses the merged counts (see 'count_words'), while the
+ * learning rate schedule and progress only count the new data
+ * ('train_words').
+ */
+char save_model_file[MAX_STRING], init_model_file[MAX_STRING];
+int *init_model_ids;
+long long init_model_size = 0, init_model_offset = 0;
+struct checkpoint_header init_model_hdr;
+
+struct merge_word {
+  long long cn, delta, str;
+  int model_id;
+};
+
+// Sorts merged words by count in descending order.
+int MergeWordCompare(const void *a, const void *b) {
+  long long d = ((struct merge_word *)b)->cn - ((struct merge_word *)a)->cn;
+  return (d > 0) - (d < 0);
 }
 
-void ReadVocab() {
-  long long a, i = 0;
-  char c;
+/**
+ * ======== MergeModelVocab ========
+ * Merges the vocabulary of 'init_model_file' into the vocabulary just
+ * learned from the new data. On entry vocab_cn[] holds the counts in the new
+ * data, with no 'min_count' applied yet.
+ */
+void MergeModelVocab() {
+  long long a, i, n, cn, size;
   char word[MAX_STRING];
-  FILE *fin = fopen(read_vocab_file, "rb");
-  if (fin == NULL) {
-    printf("Vocabulary file not found\n");
+  FILE *fin = OpenCheckpoint(init_model_file, &init_model_hdr);
+  
+  if (init_model_hdr.layer1_size != layer1_size) {
+    printf("ERROR: %s has vectors of size %lld, not %lld\n", init_model_file, init_model_hdr.layer1_size, layer1_size);
     exit(1);
   }
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  vocab_size = 0;
-  while (1) {
-    ReadWord(word, fin);
-    if (feof(fin)) break;
-    a = AddWordToVocab(word);
-    fscanf(fin, "%lld%c", &vocab[a].cn, &c);
-    i++;
+  init_model_size = init_model_hdr.vocab_size;
+  
+  // Start from the new data's words, then add the model's counts to them,
+  // appending the model's words which don't occur in the new data.
+  struct merge_word *m = (struct merge_word *)malloc((vocab_size + init_model_size) * sizeof(struct merge_word));
+  for (a = 0; a < vocab_size; a++) {
+    m[a].cn = m[a].delta = vocab_cn[a];
+    m[a].model_id = -1;
+    m[a].str = vocab_str[a];
   }
-  SortVocab();
-  if (debug_mode > 0) {
-    printf("Vocab size: %lld\n", vocab_size);
-    printf("Words in train file: %lld\n", train_words);
+  n = vocab_size;
+  for (a = 0; a < init_model_size; a++) {
+    ReadCheckpointWord(fin, init_model_file, word, &cn);
+    i = SearchVocab(word);
+    if (i == -1) {
+      i = n++;
+      m[i].cn = m[i].delta = 0;
+      m[i].str = ArenaAdd(&vocab_strings, word, strlen(word));
+    }
+    m[i].cn += cn;
+    m[i].model_id = a;
   }
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
-    printf("ERROR: training data file not found!\n");
+  init_model_offset = ftell(fin);
+  fclose(fin);
+  
+  // Drop the new words which are too rare. </s> stays first.
+  for (a = 1, size = 1; a < n; a++) {
+    if ((m[a].model_id >= 0) || (m[a].cn >= min_count)) m[size++] = m[a];
+  }
+  qsort(&m[1], size - 1, sizeof(struct merge_word), MergeWordCompare);
+  
+  // Rebuild the vocab and its hash table from the merged words.
+  ReserveVocab(size + 1);
+  init_model_ids = (int *)malloc(init_model_size * sizeof(int));
+  InitVocabHash(size);
+  train_words = count_words = 0;
+  for (a = 0; a < size; a++) {
+    vocab_cn[a] = m[a].cn;
+    vocab_str[a] = m[a].str;
+    if (m[a].model_id >= 0) init_model_ids[m[a].model_id] = a;
+    InsertVocabHash(a);
+    train_words += m[a].delta;
+    count_words += m[a].cn;
+  }
+  if (debug_mode > 0)
+    printf("Vocab size after merging %s: %lld (%lld new words)\n", init_model_file, size, size - init_model_size);
+  vocab_size = size;
+  CompactVocabStrings();
+  free(m);
+}
+
+/**
+ * ======== LoadModelLayer ========
+ * Reads one weight matrix of 'init_model_file' (stored as bf16 if
+ * 'model_bf16') and copies each row to the row of its word in 'layer' (or
+ * 'layer_bf16').
+ */
+void LoadModelLayer(FILE *fin, int model_bf16, real *layer, unsigned short *layer_bf16) {
+  long long a;
+  real *row = (real *)malloc(layer1_size * sizeof(real));
+  unsigned short *row_bf16 = (unsigned short *)malloc(layer1_size * sizeof(unsigned short));
+  
+  for (a = 0; a < init_model_size; a++) {
+    if (model_bf16) {
+      if (fread(row_bf16, sizeof(unsigned short), layer1_size, fin) != layer1_size) break;
+      Bf16ToFloat(row, row_bf16, layer1_size);
+    } else if (fread(row, sizeof(real), layer1_size, fin) != layer1_size) break;
+    if (layer_bf16 != NULL) FloatToBf16Nearest(layer_bf16 + (long long)init_model_ids[a] * layer1_size, row, layer1_size);
+    else memcpy(layer + (long long)init_model_ids[a] * layer1_size, row, layer1_size * sizeof(real));
+  }
+  if (a < init_model_size) {
+    printf("ERROR: %s is truncated\n", init_model_file);
     exit(1);
   }
-  fseek(fin, 0, SEEK_END);
-  file_size = ftell(fin);
+  free(row);
+  free(row_bf16);
+}
+
+/**
+ * ======== LoadModelWeights ========
+ * Copies the weights of 'init_model_file' into the newly initialized syn0
+ * and syn1neg (see "Incremental Training").
+ */
+void LoadModelWeights() {
+  long long a, n = init_model_size * layer1_size;
+  FILE *fin = fopen(init_model_file, "rb");
+  int model_bf16 = init_model_hdr.bf16;
+  
+  fseek(fin, init_model_offset, SEEK_SET);
+  LoadModelLayer(fin, model_bf16, syn0, syn0_bf16);
+  
+  // Skip the model's syn1, if it has one.
+  if (init_model_hdr.hs) fseek(fin, n * sizeof(real), SEEK_CUR);
+  if ((init_model_hdr.negative > 0) && (negative > 0)) {
+    LoadModelLayer(fin, model_bf16, syn1neg, syn1neg_bf16);
+    if (numa > 1) for (a = 0; a < num_numa_nodes; a++)
+      memcpy(syn1neg_replicas[a], syn1neg, (long long)vocab_size * layer1_size * sizeof(real));
+  }
   fclose(fin);
+  free(init_model_ids);
 }
 
 /**
- * ======== InitNet ========
+ * ======== TrainSharedNegativeWindow ========
+ * Skip-gram update for one whole context window when all of the context
+ * words share the same set of negative samples ('-shared-negative 1').
+ *
+ * In skip-gram the positive output is the center word, so with shared
+ * negatives every context word in the window is trained against the same
+ * output rows. The per-pair vector operations then turn into three small
+ * matrix products:
+ *
+ *   corr = in * out^T           (n_in x n_out)  - the dot products
+ *   din  = g * out              (n_in x d)      - hidden layer gradients
+ *   dout = g^T * in             (n_out x d)     - output layer gradients
  *
+ * where 'in' holds the syn0 rows of the context words, 'out' holds the
+ * syn1neg rows of the center word (column 0, label 1) and the negatives
+ * (label 0), and g is the error times the learning rate.
+ *
+ * The products are computed in column blocks of SHARED_NEG_BLOCK floats so
+ * that the block of every row involved stays in L1 while it is reused
+ * n_in or n_out times. The gradients are computed from the old weights and
+ * only added into syn0 / syn1neg at the end, as in the per-pair code.
+ *
+ * A word may appear more than once in the window, and a negative may be
+ * drawn twice, so the same row can be listed more than once in 'in' or
+ * 'out'. Each listing then gets its own update, and they add up.
+ *
+ * Parameters:
+ *   in  - The syn0 rows of the context words (see ReadRow).
+ *   out - The syn1neg rows of the center word followed by the negatives.
+ *   corr     - Scratch, n_in * n_out reals.
+ *   din      - Scratch, n_in * layer1_size reals.
+ *   dout     - Scratch, n_out * layer1_size reals.
+ *   local_alpha - The calling thread's learning rate.
  */
-void InitNet() {
-  long long a, b;
-  unsigned long long next_random = 1;
-  
-  // Allocate the hidden layer of the network, which is what becomes the word vectors.
-  // The variable for this layer is 'syn0'.
-  a = posix_memalign((void **)&syn0, 128, (long long)vocab_size * layer1_size * sizeof(real));
+void TrainSharedNegativeWindow(real **in, long long n_in, real **out, long long n_out,
+                               real *corr, real *din, real *dout, real local_alpha) {
+  long long i, j, c0, len;
+  real f;
   
-  if (syn0 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (i = 0; i < n_in * n_out; i++) corr[i] = 0;
+  for (i = 0; i < n_in * layer1_size; i++) din[i] = 0;
+  for (i = 0; i < n_out * layer1_size; i++) dout[i] = 0;
   
-  // If we're using hierarchical softmax for training...
-  if (hs) {
-    a = posix_memalign((void **)&syn1, 128, (long long)vocab_size * layer1_size * sizeof(real));
-    if (syn1 == NULL) {printf("Memory allocation failed\n"); exit(1);}
-    for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++)
-     syn1[a * layer1_size + b] = 0;
+  // corr = in * out^T
+  for (c0 = 0; c0 < layer1_size; c0 += SHARED_NEG_BLOCK) {
+    len = layer1_size - c0;
+    if (len > SHARED_NEG_BLOCK) len = SHARED_NEG_BLOCK;
+    for (i = 0; i < n_in; i++) for (j = 0; j < n_out; j++)
+      corr[i * n_out + j] += VecDot(in[i] + c0, out[j] + c0, len);
   }
   
-  // If we're using negative sampling for training...
-  if (negative>0) {
-    // Allocate the output layer of the network. 
-    // The variable for this layer is 'syn1neg'.
-    // This layer has the same size as the hidden layer, but is the transpose.
-    a = posix_memalign((void **)&syn1neg, 128, (long long)vocab_size * layer1_size * sizeof(real));
-    
-    if (syn1neg == NULL) {printf("Memory allocation failed\n"); exit(1);}
-    
-    // Set all of the weights in the output layer to 0.
-    for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++)
-     syn1neg[a * layer1_size + b] = 0;
+  // Replace each dot product with its error times the learning rate, using
+  // the same expTable lookup as the per-pair code.
+  for (i = 0; i < n_in; i++) for (j = 0; j < n_out; j++) {
+    f = corr[i * n_out + j];
+    if (f > MAX_EXP) corr[i * n_out + j] = ((j == 0) - 1) * local_alpha;
+    else if (f < -MAX_EXP) corr[i * n_out + j] = (j == 0) * local_alpha;
+    else corr[i * n_out + j] = ((j == 0) - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * local_alpha;
   }
   
-  // Randomly initialize the weights for the hidden layer (word vector layer).
-  // TODO - What's the equation here?
-  for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++) {
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    syn0[a * layer1_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
+  // din = g * out, dout = g^T * in
+  for (c0 = 0; c0 < layer1_size; c0 += SHARED_NEG_BLOCK) {
+    len = layer1_size - c0;
+    if (len > SHARED_NEG_BLOCK) len = SHARED_NEG_BLOCK;
+    for (i = 0; i < n_in; i++) for (j = 0; j < n_out; j++)
+      VecAxpy(din + i * layer1_size + c0, out[j] + c0, corr[i * n_out + j], len);
+    for (j = 0; j < n_out; j++) for (i = 0; i < n_in; i++)
+      VecAxpy(dout + j * layer1_size + c0, in[i] + c0, corr[i * n_out + j], len);
   }
   
-  // Create a binary tree for Huffman coding.
-  // TODO - As best I can tell, this is only used for hierarchical softmax training...
-  CreateBinaryTree();
+  // Apply the accumulated updates.
+  for (i = 0; i < n_in; i++) VecAxpy(in[i], din + i * layer1_size, 1, layer1_size);
+  for (j = 0; j < n_out; j++) VecAxpy(out[j], dout + j * layer1_size, 1, layer1_size);
+}
+
+/**
+ * ======== FirstIndex ========
+ * Returns the index of the first occurrence of ids[n] in ids[0..n].
+ */
+static inline long long FirstIndex(const long long *ids, long long n) {
+  long long i = 0;
+  while (ids[i] != ids[n]) i++;
+  return i;
 }
 
 /**
@@ -787,25 +4437,119 @@ void *TrainModelThread(void *id) {
   /*
    * word - Stores the index of a word in the vocab table.
    * word_count - Stores the total number of training words processed.
+   * word_count_actual - The number of words processed by all threads, as
+   *                     of the last progress update.
+   * local_alpha - This thread's learning rate (see the progress update).
    */
   long long a, b, d, cw, word, last_word, sentence_length = 0, sentence_position = 0;
-  long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1];
-  long long l1, l2, c, target, label, local_iter = iter;
-  unsigned long long next_random = (long long)id;
-  real f, g;
+  long long word_count = 0, last_word_count = 0, word_count_actual, sen[MAX_SENTENCE_LENGTH + 1];
+  long long l2, c, target, label, n_neg;
+  long long row_updates = 0, hot_updates = 0, merge_writes = 0;
+  real f, g, local_alpha = starting_alpha, new_alpha, *in_row, *hs_row, *out_row;
+  const unsigned short *noise;
   clock_t now;
   
+  // Run on this thread's NUMA node, and train against that node's copy of
+  // the output layer. 'next_sync' is the word count at which this thread
+  // next merges its slice of the replicas.
+  PinThread((long long)id);
+  real *out_layer = (numa > 1) ? syn1neg_replicas[ThreadNode((long long)id)] : syn1neg;
+  long long next_sync = numa_sync, next_worker_sync = worker_sync;
+  
   // neu1 is only used by the CBOW architecture.
   real *neu1 = (real *)calloc(layer1_size, sizeof(real));
   
   // neu1e is used by both architectures.
   real *neu1e = (real *)calloc(layer1_size, sizeof(real));
   
+  // With '-bf16 1', the syn0 rows being trained are converted into 'in_buf'
+  // (see ReadRow).
+  real *in_buf = (real *)malloc(layer1_size * sizeof(real));
+  
+  // This thread's copy of the top HS rows, and those rows as of the last
+  // merge (see "HS Private Rows"). Both start out zero, so the first merge
+  // just copies syn1.
+  real *hs_priv = NULL, *hs_base = NULL;
+  long long next_hs_sync = hs_private_sync;
+  if (hs && (hs_private_rows > 0)) {
+    hs_priv = (real *)calloc(hs_private_rows * layer1_size, sizeof(real));
+    hs_base = (real *)calloc(hs_private_rows * layer1_size, sizeof(real));
+    MergeHsPrivate(hs_priv, hs_base);
+  }
+  
+  // This thread's random number buffer (see "Random Numbers").
+  struct rng_buffer *rng;
+  if (posix_memalign((void **)&rng, 128, sizeof(struct rng_buffer))) {printf("Memory allocation failed\n"); exit(1);}
+  RngSeed(rng, seed, (worker_id < 0 ? 0 : worker_id) * (long long)num_threads + (long long)id);
+  
+  // This thread's copies of the hot rows of syn0 and syn1neg (see "Hot
+  // Rows"). Like the HS private rows, they start out zero and unchanged, so
+  // the first merge just copies the shared weights.
+  struct hot_copy hot_in = {NULL, NULL, NULL}, hot_out = {NULL, NULL, NULL};
+  long long next_hot_sync = hot_sync;
+  if (hot_words > 0) {
+    hot_in.rows = (real *)calloc(hot_words * layer1_size, sizeof(real));
+    hot_in.base = (real *)calloc(hot_words * layer1_size, sizeof(real));
+    hot_in.dirty = (unsigned char *)calloc(hot_words, 1);
+    MergeHotRows(&hot_in, syn0, syn0_bf16, in_buf, rng);
+    if (negative > 0) {
+      hot_out.rows = (real *)calloc(hot_words * layer1_size, sizeof(real));
+      hot_out.base = (real *)calloc(hot_words * layer1_size, sizeof(real));
+      hot_out.dirty = (unsigned char *)calloc(hot_words, 1);
+      MergeHotRows(&hot_out, out_layer, syn1neg_bf16, in_buf, rng);
+    }
+  }
+  
+  // The negative samples for the current window. CBOW needs 'negative' of
+  // them; skip-gram needs 'negative' for each of up to 'window * 2' context
+  // words.
+  long long *neg = NULL;
+  if (negative > 0) neg = (long long *)malloc((window * 2 + 1) * negative * sizeof(long long));
   
-  // Open the training file and seek to the portion of the file that this 
-  // thread is responsible for.
-  FILE *fi = fopen(train_file, "rb");
-  fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+  // Scratch space for '-shared-negative 1' (skip-gram only). 'ctx' holds the
+  // context words of the current window, and 'out' the center word followed
+  // by the shared negative samples. 'ctx_rows' and 'out_rows' point to their
+  // weights, which are converted into 'ctx_buf' and 'out_bufs' with '-bf16'.
+  long long cw_max = window * 2, *ctx = NULL, *out = NULL, n_out;
+  real *corr = NULL, *din = NULL, *dout = NULL, **ctx_rows = NULL, **out_rows = NULL;
+  real *ctx_buf = NULL, *out_bufs = NULL;
+  if (shared_negative && !cbow && negative > 0) {
+    ctx = (long long *)malloc(cw_max * sizeof(long long));
+    out = (long long *)malloc((negative + 1) * sizeof(long long));
+    ctx_rows = (real **)malloc(cw_max * sizeof(real *));
+    out_rows = (real **)malloc((negative + 1) * sizeof(real *));
+    ctx_buf = (real *)malloc(cw_max * layer1_size * sizeof(real));
+    out_bufs = (real *)malloc((negative + 1) * layer1_size * sizeof(real));
+    corr = (real *)malloc(cw_max * (negative + 1) * sizeof(real));
+    din = (real *)malloc(cw_max * layer1_size * sizeof(real));
+    dout = (real *)malloc((negative + 1) * layer1_size * sizeof(real));
+  }
+  
+  
+  // The thread trains one work chunk at a time (see ClaimTask). The current
+  // chunk is [chunk_pos, chunk_end), in bytes of the training file, or in ids
+  // with '-ids'.
+  //
+  // With streamed input, a chunk is a batch of ids from 'stream_full'
+  // instead (see "Streaming Input"). 'ids' points to the ids being trained,
+  // if the data isn't read as text.
+  struct text_reader *fi = NULL;
+  struct stream_batch *batch = NULL;
+  int *ids = corpus_ids;
+  long long task, chunk_pos = 0, chunk_end = 0;
+  if ((corpus_ids == NULL) && !stream) fi = OpenReader(train_file);
+  
+  // When resuming, pick up where this thread was at the checkpoint.
+  if (resume_file[0] != 0) {
+    struct thread_state *s = &thread_states[(long long)id];
+    memcpy(rng, &s->rng, sizeof(struct rng_buffer));
+    word_count = s->word_count;
+    last_word_count = s->last_word_count;
+    local_alpha = s->alpha;
+    chunk_pos = s->chunk_pos;
+    chunk_end = s->chunk_end;
+    if ((fi != NULL) && (chunk_pos < chunk_end)) SeekReader(fi, chunk_pos);
+  }
   
   // This loop covers the whole training operation...
   while (1) {
@@ -820,8 +4564,14 @@ void *TrainModelThread(void *id) {
     
     // This block prints a progress update, and also adjusts the training 
     // 'alpha' parameter.
+    //
+    // Each thread publishes its own word count, and computes its own alpha
+    // from the total over all threads. No shared variables are written.
     if (word_count - last_word_count > 10000) {
-      word_count_actual += word_count - last_word_count;
+      __atomic_store_n(&thread_stats[(long long)id].words, word_count, __ATOMIC_RELAXED);
+      if (workers > 0)
+        __atomic_store_n(&worker_shared->words[worker_id * num_threads + (long long)id], word_count, __ATOMIC_RELAXED);
+      word_count_actual = WordCountActual();
       
       last_word_count = word_count;
       
@@ -829,7 +4579,7 @@ void *TrainModelThread(void *id) {
       // doing and not just the current pass.      
       if ((debug_mode > 1)) {
         now=clock();
-        printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, alpha,
+        printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, local_alpha,
          // Percent complete = [# of input words processed] / 
          //                      ([# of passes] * [# of words in a pass])
          word_count_actual / (real)(iter * train_words + 1) * 100,
@@ -840,21 +4590,99 @@ void *TrainModelThread(void *id) {
       // Update alpha to: [initial alpha] * [percent of training remaining]
       // This means that alpha will gradually decrease as we progress through 
       // the training text.
-      alpha = starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
+      new_alpha = starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
       // Don't let alpha go below [initial alpha] * 0.0001.
-      if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
+      if (new_alpha < starting_alpha * 0.0001) new_alpha = starting_alpha * 0.0001;
+      // The total only grows, but be explicit that alpha never goes back up.
+      if (new_alpha < local_alpha) local_alpha = new_alpha;
     }
     
     // This 'if' block retrieves the next sentence from the training text and
     // stores it in 'sen'.
     // TODO - Under what condition would sentence_length not be zero?
     if (sentence_length == 0) {
+      // A checkpoint has been requested (see "Checkpoints"). Merge the
+      // private rows now, so that the snapshot includes them.
+      int pause = __atomic_load_n(&checkpoint_requested, __ATOMIC_ACQUIRE);
+      if (pause) next_hs_sync = next_hot_sync = word_count;
+      
+      // Periodically merge this thread's slice of the syn1neg replicas. Like
+      // the merges below, this is checked per sentence, so that a 'numa_sync'
+      // under 10000 words is honoured.
+      if ((numa > 1) && (negative > 0) && (word_count >= next_sync)) {
+        MergeReplicas(vocab_size * (long long)id / num_threads, vocab_size * ((long long)id + 1) / num_threads);
+        next_sync = word_count + numa_sync;
+      }
+      
+      // Likewise, sync this thread's slice of the rows with the other workers.
+      if ((workers > 0) && (word_count >= next_worker_sync)) {
+        SyncWorkerRows(vocab_size * (long long)id / num_threads, vocab_size * ((long long)id + 1) / num_threads);
+        next_worker_sync = word_count + worker_sync;
+      }
+      
+      // Merge this thread's copy of the top HS rows every 'hs_private_sync'
+      // words. This is checked per sentence rather than with the progress
+      // update above, which only runs every 10000 words.
+      if ((hs_priv != NULL) && (word_count >= next_hs_sync)) {
+        MergeHsPrivate(hs_priv, hs_base);
+        next_hs_sync = word_count + hs_private_sync;
+      }
+      
+      // Likewise for the hot rows of syn0 and syn1neg.
+      if ((hot_words > 0) && (word_count >= next_hot_sync)) {
+        merge_writes += MergeHotRows(&hot_in, syn0, syn0_bf16, in_buf, rng);
+        if (negative > 0) merge_writes += MergeHotRows(&hot_out, out_layer, syn1neg_bf16, in_buf, rng);
+        next_hot_sync = word_count + hot_sync;
+      }
+      
+      // Record where this thread is, and wait while the snapshot is taken.
+      if (pause) {
+        struct thread_state *s = &thread_states[(long long)id];
+        s->chunk_pos = chunk_pos;
+        s->chunk_end = chunk_end;
+        s->word_count = word_count;
+        s->last_word_count = last_word_count;
+        s->alpha = local_alpha;
+        memcpy(&s->rng, rng, sizeof(struct rng_buffer));
+        PauseForCheckpoint();
+      }
+      
+      // Move on to a new chunk once the current one has been used up. The
+      // thread is done when there are no chunks left to claim or steal.
+      if (chunk_pos >= chunk_end) {
+        if (stream) {
+          if (batch != NULL) StreamPush(&stream_free, batch);
+          batch = StreamPop(&stream_full);
+          if (batch == NULL) break;
+          thread_stats[(long long)id].chunks++;
+          ids = batch->ids;
+          chunk_pos = 0;
+          chunk_end = batch->len;
+        } else {
+          task = ClaimTask((long long)id);
+          if (task < 0) break;
+          chunk_pos = work_chunks[task % num_work_chunks].start;
+          chunk_end = work_chunks[task % num_work_chunks].end;
+          if (fi != NULL) SeekReader(fi, chunk_pos);
+        }
+      }
+      
       while (1) {
+        // Chunks end on sentence boundaries, so the end of the chunk is also
+        // the end of the sentence.
+        if (chunk_pos >= chunk_end) break;
+        
         // Read the next word from the training data and lookup its index in 
         // the vocab table. 'word' is the word's vocab index.
-        word = ReadWordIndex(fi);
-        
-        if (feof(fi)) break;
+        if (ids != NULL) word = ids[chunk_pos++];
+        else {
+          word = ReadWordIndex(fi);
+          chunk_pos = ReaderTell(fi);
+          if (fi->eof) {
+            chunk_pos = chunk_end;
+            break;
+          }
+        }
         
         // If the word doesn't exist in the vocabulary, skip it.
         if (word == -1) continue;
@@ -880,7 +4708,7 @@ void *TrainModelThread(void *id) {
          * than this number, we discard the word. This means that the smaller 
          * 'ran' is, the more likely it is that we'll discard this word. 
          *
-         * The quantity (vocab[word].cn / train_words) is the fraction of all 
+         * The quantity (vocab_cn[word] / count_words) is the fraction of all 
          * the training words which are 'word'. Let's represent this fraction
          * by x.
          *
@@ -911,18 +4739,10 @@ void *TrainModelThread(void *id) {
          */
         if (sample > 0) {
           // Calculate the probability of keeping 'word'.
-          real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[word].cn;
+          real ran = (sqrt(vocab_cn[word] / (sample * count_words)) + 1) * (sample * count_words) / vocab_cn[word];
           
-          // Generate a random number.
-          // The multiplier is 25.xxx billion, so 'next_random' is a 64-bit integer.
-          next_random = next_random * (unsigned long long)25214903917 + 11;
-
           // If the probability is less than a random fraction, discard the word.
-          //
-          // (next_random & 0xFFFF) extracts just the lower 16 bits of the 
-          // random number. Dividing this by 65536 (2^16) gives us a fraction
-          // between 0 and 1. So the code is just generating a random fraction.
-          if (ran < (next_random & 0xFFFF) / (real)65536) continue;
+          if (ran < RngFraction(rng)) continue;
         }
         
         // If we kept the word, add it to the sentence.
@@ -935,16 +4755,9 @@ void *TrainModelThread(void *id) {
       
       sentence_position = 0;
     }
-    if (feof(fi) || (word_count > train_words / num_threads)) {
-      word_count_actual += word_count - last_word_count;
-      local_iter--;
-      if (local_iter == 0) break;
-      word_count = 0;
-      last_word_count = 0;
-      sentence_length = 0;
-      fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
-      continue;
-    }
+    
+    // Skip empty sentences (blank lines).
+    if (sentence_length == 0) continue;
     
     // Get the next word in the sentence. The word is represented by its index
     // into the vocab table.
@@ -955,13 +4768,17 @@ void *TrainModelThread(void *id) {
     for (c = 0; c < layer1_size; c++) neu1[c] = 0;
     for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
     
-    // This is a standard random integer generator, as seen here:
-    // https://en.wikipedia.org/wiki/Linear_congruential_generator
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    
     // 'b' becomes a random integer between 0 and 'window' - 1.
     // This is the amount we will shrink the window size by.
-    b = next_random % window;
+    b = RngNext(rng) % window;
+    
+    // Draw all of the negative samples for this window up front, so that
+    // the training loops below only have to read them from 'neg'. With
+    // shared negatives, skip-gram uses a single set for the whole window.
+    if (negative > 0) {
+      n_neg = (cbow || ctx != NULL) ? negative : (window - b) * 2 * negative;
+      for (d = 0; d < n_neg; d++) neg[d] = DrawNegative(RngNext(rng));
+    }
     
     /* 
      * ====================================
@@ -1035,7 +4852,8 @@ void *TrainModelThread(void *id) {
         // Add the word vector for this context word to the running sum in 
         // neur1.
         // `layer1_size` is 300, `neu1` is length 300
-        for (c = 0; c < layer1_size; c++) neu1[c] += syn0[c + last_word * layer1_size];
+        in_row = ReadHotRow(&hot_in, syn0, syn0_bf16, last_word, in_buf);
+        for (c = 0; c < layer1_size; c++) neu1[c] += in_row[c];
         
         // Count the number of context words.
         cw++;
@@ -1049,25 +4867,29 @@ void *TrainModelThread(void *id) {
         for (c = 0; c < layer1_size; c++) neu1[c] /= cw;
         
         // // HIERARCHICAL SOFTMAX
-        // vocab[word]
-        //   .point - A variable-length list of row ids, which are the output
-        //            rows to train on.
-        //   .code - A variable-length list of 0s and 1s, which are the desired
-        //           labels for the outputs in `point`.
-        //   .codelen - The length of the `code` array for this 
-        //              word.
+        // Entries [code_start[word], code_start[word + 1]) of
+        //   code_points - A variable-length list of row ids, which are the
+        //                 output rows to train on.
+        //   code_bits - A variable-length list of 0s and 1s, which are the
+        //               desired labels for the outputs in `code_points`.
         // 
-        if (hs) for (d = 0; d < vocab[word].codelen; d++) {
+        if (hs) for (d = code_start[word]; d < code_start[word + 1]; d++) {
           f = 0;
-          // point[d] is the index of a row of the ouput matrix.
+          // code_points[d] is the index of a row of the ouput matrix.
           // l2 is the index of that word in the output layer weights (syn1).
-          l2 = vocab[word].point[d] * layer1_size;
+          l2 = code_points[d] * layer1_size;
+          
+          // The path starts at the root, so its first 'hs_private_levels'
+          // rows are in this thread's private copy.
+          hs_row = syn1 + l2;
+          if (d - code_start[word] < hs_private_levels)
+            hs_row = hs_priv + (long long)hs_private_slot[code_points[d]] * layer1_size;
           
           // Propagate hidden -> output
           // neu1 is the average of the context words from the hidden layer.
           // This loop computes the dot product between neu1 and the output
-          // weights for the output word at point[d].
-          for (c = 0; c < layer1_size; c++) f += neu1[c] * syn1[c + l2];
+          // weights for the output word at code_points[d].
+          f = VecDot(neu1, hs_row, layer1_size);
           
           // Apply the sigmoid activation to the current output neuron.
           if (f <= -MAX_EXP) continue;
@@ -1077,11 +4899,11 @@ void *TrainModelThread(void *id) {
           // 'g' is the error multiplied by the learning rate.
           // The error is (label - f), so label = (1 - code), meaning if
           // code is 0, then this is a positive sample and vice versa.
-          g = (1 - vocab[word].code[d] - f) * alpha;
-          // Propagate errors output -> hidden
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1[c + l2];
-          // Learn weights hidden -> output
-          for (c = 0; c < layer1_size; c++) syn1[c + l2] += g * neu1[c];
+          g = (1 - ((code_bits[d >> 3] >> (d & 7)) & 1) - f) * local_alpha;
+          // Propagate errors output -> hidden, and learn weights
+          // hidden -> output.
+          VecDualAxpy(neu1e, hs_row, neu1, g, layer1_size);
+          TouchRow(syn1_touched, code_points[d]);
         }
         
         // NEGATIVE SAMPLING
@@ -1098,19 +4920,12 @@ void *TrainModelThread(void *id) {
           
           // On the other iterations, we'll train the negative samples.
           } else {
-            // Pick a random word to use as a 'negative sample'; do this using 
-            // the unigram table.
-            
-            // Get a random integer.              
-            next_random = next_random * (unsigned long long)25214903917 + 11;
+            // Take the next 'negative sample', which was drawn from the
+            // unigram distribution above (see DrawNegative).
             
             // 'target' becomes the index of the word in the vocab to use as
             // the negative sample.            
-            target = table[(next_random >> 16) % table_size];
-            
-            // If the target is the special end of sentence token, then just
-            // pick a random word from the vocabulary instead.            
-            if (target == 0) target = next_random % (vocab_size - 1) + 1;
+            target = neg[d - 1];
 
             // Don't use the positive sample as a negative sample!            
             if (target == word) continue;
@@ -1125,11 +4940,20 @@ void *TrainModelThread(void *id) {
           // Get the index of the target word in the output layer.
           l2 = target * layer1_size;
           
+          // The target's output weights: this thread's copy if it is a hot
+          // row, otherwise the shared row (NULL if that is stored in bf16).
+          if (target < hot_words) {
+            out_row = hot_out.rows + l2;
+            hot_out.dirty[target] = 1;
+            hot_updates++;
+          } else out_row = bf16 ? NULL : out_layer + l2;
+          row_updates++;
+          
           // Calculate the dot product between:
           //   neu1 - The average of the context word vectors.
           //   syn1neg[l2] - The output weights for the target word.
-          f = 0;
-          for (c = 0; c < layer1_size; c++) f += neu1[c] * syn1neg[c + l2];
+          if (out_row == NULL) f = VecDotBf16(neu1, syn1neg_bf16 + l2, layer1_size);
+          else f = VecDot(neu1, out_row, layer1_size);
 
           // This block does two things:
           //   1. Calculates the output of the network for this training
@@ -1138,18 +4962,23 @@ void *TrainModelThread(void *id) {
           //   2. Calculate the error at the output, stored in 'g', by
           //      subtracting the network output from the desired output, 
           //      and finally multiply this by the learning rate.          
-          if (f > MAX_EXP) g = (label - 1) * alpha;
-          else if (f < -MAX_EXP) g = (label - 0) * alpha;
-          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
+          if (f > MAX_EXP) g = (label - 1) * local_alpha;
+          else if (f < -MAX_EXP) g = (label - 0) * local_alpha;
+          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * local_alpha;
           
           // Multiply the error by the output layer weights.
           // (I think this is the gradient calculation?)
-          // Accumulate these gradients over all of the negative samples.          
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
-
-          // Update the output layer weights by multiplying the output error
-          // by the average of the context word vectors.
-          for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * neu1[c];
+          // Accumulate these gradients over all of the negative samples.
+          //
+          // Then update the output layer weights by multiplying the output
+          // error by the average of the context word vectors.
+          //
+          // Both steps are done in a single pass over the output row.
+          if (out_row == NULL) {
+            noise = RngNoise(rng);
+            VecDualAxpyBf16(neu1e, syn1neg_bf16 + l2, neu1, g, layer1_size, noise);
+          } else VecDualAxpy(neu1e, out_row, neu1, g, layer1_size);
+          TouchRow(syn1neg_touched, target);
         }
          
         // hidden -> in
@@ -1181,7 +5010,11 @@ void *TrainModelThread(void *id) {
           // Add the gradient in the vector `neu1e` to the word vector for
           // the current context word.
           // syn0[last_word * layer1_size] <-- Accesses the word vector.
-          for (c = 0; c < layer1_size; c++) syn0[c + last_word * layer1_size] += neu1e[c];
+          in_row = ReadHotRow(&hot_in, syn0, syn0_bf16, last_word, in_buf);
+          for (c = 0; c < layer1_size; c++) in_row[c] += neu1e[c];
+          hot_updates += WriteHotRow(&hot_in, syn0_bf16, last_word, in_row, rng);
+          row_updates++;
+          TouchRow(syn0_touched, last_word);
         }
       }
     } 
@@ -1208,8 +5041,8 @@ void *TrainModelThread(void *id) {
      * syn0 - The hidden layer weights. Note that the weights are stored as a
      *        1D array, so word 'i' is found at (i * layer1_size).
      *
-     * l1 - Index into the hidden layer (syn0). Index of the start of the
-     *      weights for the current input word.
+     * in_row - The hidden layer (syn0) weights for the current input word,
+     *          as returned by ReadRow.
      *
      * target - The output word we're working on. If it's the positive sample
      *          then `label` is 1. `label` is 0 for negative samples.
@@ -1217,6 +5050,9 @@ void *TrainModelThread(void *id) {
      *                and not HS.     
      */
     else {  
+      // Number of context words seen so far in this window.
+      cw = 0;
+      
       // Loop over the positions in the context window (skipping the word at
       // the center). 'a' is just the offset within the window, it's not 
       // the index relative to the beginning of the sentence.
@@ -1243,26 +5079,35 @@ void *TrainModelThread(void *id) {
         // ever be the case?)
         if (last_word == -1) continue;
         
-        // Calculate the index of the start of the weights for 'last_word'.
-        l1 = last_word * layer1_size;
+        // With shared negatives, the negative sampling update is done for the
+        // whole window at once after this loop; only HS is still per pair.
+        if (ctx != NULL) {
+          ctx[cw++] = last_word;
+          if (!hs) continue;
+        }
+        
+        // Get the weights for 'last_word'.
+        in_row = ReadHotRow(&hot_in, syn0, syn0_bf16, last_word, in_buf);
         
         for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
         
         // HIERARCHICAL SOFTMAX
-        if (hs) for (d = 0; d < vocab[word].codelen; d++) {
-          f = 0;
-          l2 = vocab[word].point[d] * layer1_size;
+        if (hs) for (d = code_start[word]; d < code_start[word + 1]; d++) {
+          l2 = code_points[d] * layer1_size;
+          hs_row = syn1 + l2;
+          if (d - code_start[word] < hs_private_levels)
+            hs_row = hs_priv + (long long)hs_private_slot[code_points[d]] * layer1_size;
           // Propagate hidden -> output
-          for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1[c + l2];
+          f = VecDot(in_row, hs_row, layer1_size);
           if (f <= -MAX_EXP) continue;
           else if (f >= MAX_EXP) continue;
           else f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
           // 'g' is the gradient multiplied by the learning rate
-          g = (1 - vocab[word].code[d] - f) * alpha;
-          // Propagate errors output -> hidden
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1[c + l2];
-          // Learn weights hidden -> output
-          for (c = 0; c < layer1_size; c++) syn1[c + l2] += g * syn0[c + l1];
+          g = (1 - ((code_bits[d >> 3] >> (d & 7)) & 1) - f) * local_alpha;
+          // Propagate errors output -> hidden, and learn weights
+          // hidden -> output.
+          VecDualAxpy(neu1e, hs_row, in_row, g, layer1_size);
+          TouchRow(syn1_touched, code_points[d]);
         }
         
         // NEGATIVE SAMPLING
@@ -1271,26 +5116,19 @@ void *TrainModelThread(void *id) {
         // is given by 'negative').
         // These words are selected using a "unigram" distribution, which is generated
         // in the function InitUnigramTable
-        if (negative > 0) for (d = 0; d < negative + 1; d++) {
+        if ((negative > 0) && (ctx == NULL)) for (d = 0; d < negative + 1; d++) {
           // On the first iteration, we're going to train the positive sample.
           if (d == 0) {
             target = word;
             label = 1;
           // On the other iterations, we'll train the negative samples.
           } else {
-            // Pick a random word to use as a 'negative sample'; do this using 
-            // the unigram table.
-            
-            // Get a random integer.
-            next_random = next_random * (unsigned long long)25214903917 + 11;
+            // Take this context word's next 'negative sample', which was
+            // drawn from the unigram distribution above (see DrawNegative).
             
             // 'target' becomes the index of the word in the vocab to use as
             // the negative sample.
-            target = table[(next_random >> 16) % table_size];
-            
-            // If the target is the special end of sentence token, then just
-            // pick a random word from the vocabulary instead.
-            if (target == 0) target = next_random % (vocab_size - 1) + 1;
+            target = neg[cw * negative + d - 1];
             
             // Don't use the positive sample as a negative sample!
             if (target == word) continue;
@@ -1299,21 +5137,26 @@ void *TrainModelThread(void *id) {
             label = 0;
           }
           
-          // Get the index of the target word in the output layer.
+          // Get the index of the target word in the output layer, and its
+          // weights (see the CBOW code above).
           l2 = target * layer1_size;
+          if (target < hot_words) {
+            out_row = hot_out.rows + l2;
+            hot_out.dirty[target] = 1;
+            hot_updates++;
+          } else out_row = bf16 ? NULL : out_layer + l2;
+          row_updates++;
           
-          // At this point, our two words are represented by their index into
-          // the layer weights.
-          // l1 - The index of our input word within the hidden layer weights.
+          // At this point, our two words are represented by their weights.
+          // in_row - The input word's row of the hidden layer weights.
           // l2 - The index of our output word within the output layer weights.
           // label - Whether this is a positive (1) or negative (0) example.
           
           // Calculate the dot-product between the input words weights (in 
           // syn0) and the output word's weights (in syn1neg).
-          // Note that this calculates the dot-product manually using a for
-          // loop over the vector elements!
-          f = 0;
-          for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1neg[c + l2];
+          // See the "Vector Kernels" section for the implementations.
+          if (out_row == NULL) f = VecDotBf16(in_row, syn1neg_bf16 + l2, layer1_size);
+          else f = VecDot(in_row, out_row, layer1_size);
           
           // This block does two things:
           //   1. Calculates the output of the network for this training
@@ -1322,24 +5165,63 @@ void *TrainModelThread(void *id) {
           //   2. Calculate the error at the output, stored in 'g', by
           //      subtracting the network output from the desired output, 
           //      and finally multiply this by the learning rate.
-          if (f > MAX_EXP) g = (label - 1) * alpha;
-          else if (f < -MAX_EXP) g = (label - 0) * alpha;
-          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
+          if (f > MAX_EXP) g = (label - 1) * local_alpha;
+          else if (f < -MAX_EXP) g = (label - 0) * local_alpha;
+          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * local_alpha;
           
           // Multiply the error by the output layer weights.
           // Accumulate these gradients over the negative samples and the one
           // positive sample.
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
-          
-          // Update the output layer weights by multiplying the output error
-          // by the hidden layer weights.
-          for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * syn0[c + l1];
+          //
+          // Then update the output layer weights by multiplying the output
+          // error by the hidden layer weights.
+          if (out_row == NULL) {
+            noise = RngNoise(rng);
+            VecDualAxpyBf16(neu1e, syn1neg_bf16 + l2, in_row, g, layer1_size, noise);
+          } else VecDualAxpy(neu1e, out_row, in_row, g, layer1_size);
+          TouchRow(syn1neg_touched, target);
         }
         // Once the hidden layer gradients for the negative samples plus the 
         // one positive sample have been accumulated, update the hidden layer
         // weights. 
         // Note that we do not average the gradient before applying it.
-        for (c = 0; c < layer1_size; c++) syn0[c + l1] += neu1e[c];
+        for (c = 0; c < layer1_size; c++) in_row[c] += neu1e[c];
+        hot_updates += WriteHotRow(&hot_in, syn0_bf16, last_word, in_row, rng);
+        row_updates++;
+        TouchRow(syn0_touched, last_word);
+        
+        // Move on to the next context word's negatives.
+        if (ctx == NULL) cw++;
+      }
+      
+      // SHARED NEGATIVE SAMPLING
+      // Draw one set of negatives for the whole window, then train every
+      // context word against the center word and those negatives together.
+      if ((ctx != NULL) && (cw > 0)) {
+        out[0] = word;
+        n_out = 1;
+        for (d = 0; d < negative; d++) if (neg[d] != word) out[n_out++] = neg[d];
+        
+        // A word which appears more than once shares the first copy's row,
+        // as it does in fp32, so that with '-bf16 1' all of its updates go
+        // into one buffer, which is written back once.
+        for (a = 0; a < cw; a++) {
+          b = FirstIndex(ctx, a);
+          ctx_rows[a] = (b < a) ? ctx_rows[b] : ReadHotRow(&hot_in, syn0, syn0_bf16, ctx[a], ctx_buf + a * layer1_size);
+        }
+        for (d = 0; d < n_out; d++) {
+          b = FirstIndex(out, d);
+          out_rows[d] = (b < d) ? out_rows[b]
+                                : ReadHotRow(&hot_out, out_layer, syn1neg_bf16, out[d], out_bufs + d * layer1_size);
+        }
+        TrainSharedNegativeWindow(ctx_rows, cw, out_rows, n_out, corr, din, dout, local_alpha);
+        for (a = 0; a < cw; a++) if (FirstIndex(ctx, a) == a)
+          hot_updates += WriteHotRow(&hot_in, syn0_bf16, ctx[a], ctx_rows[a], rng);
+        for (d = 0; d < n_out; d++) if (FirstIndex(out, d) == d)
+          hot_updates += WriteHotRow(&hot_out, syn1neg_bf16, out[d], out_rows[d], rng);
+        row_updates += cw + n_out;
+        for (a = 0; a < cw; a++) TouchRow(syn0_touched, ctx[a]);
+        for (d = 0; d < n_out; d++) TouchRow(syn1neg_touched, out[d]);
       }
     }
     
@@ -1354,9 +5236,52 @@ void *TrainModelThread(void *id) {
       continue;
     }
   }
-  fclose(fi);
+  __atomic_store_n(&thread_stats[(long long)id].words, word_count, __ATOMIC_RELAXED);
+  thread_stats[(long long)id].busy = WallTime() - train_start_time;
+  if (workers > 0)
+    __atomic_store_n(&worker_shared->words[worker_id * num_threads + (long long)id], word_count, __ATOMIC_RELAXED);
+  if (hs_priv != NULL) MergeHsPrivate(hs_priv, hs_base);
+  if (hot_words > 0) {
+    merge_writes += MergeHotRows(&hot_in, syn0, syn0_bf16, in_buf, rng);
+    if (negative > 0) merge_writes += MergeHotRows(&hot_out, out_layer, syn1neg_bf16, in_buf, rng);
+  }
+  thread_stats[(long long)id].row_updates = row_updates;
+  thread_stats[(long long)id].hot_updates = hot_updates;
+  thread_stats[(long long)id].merge_writes = merge_writes;
+  
+  // This thread has run out of work; it no longer takes part in checkpoints,
+  // but its final word count still goes into them.
+  pthread_mutex_lock(&checkpoint_mutex);
+  thread_states[(long long)id].chunk_pos = thread_states[(long long)id].chunk_end = 0;
+  thread_states[(long long)id].word_count = word_count;
+  thread_states[(long long)id].alpha = local_alpha;
+  memcpy(&thread_states[(long long)id].rng, rng, sizeof(struct rng_buffer));
+  threads_running--;
+  pthread_cond_broadcast(&checkpoint_cond);
+  pthread_mutex_unlock(&checkpoint_mutex);
+  if (fi != NULL) CloseReader(fi);
   free(neu1);
   free(neu1e);
+  free(in_buf);
+  free(hs_priv);
+  free(hs_base);
+  free(hot_in.rows);
+  free(hot_in.base);
+  free(hot_in.dirty);
+  free(hot_out.rows);
+  free(hot_out.base);
+  free(hot_out.dirty);
+  free(rng);
+  free(neg);
+  free(ctx);
+  free(ctx_rows);
+  free(out_rows);
+  free(ctx_buf);
+  free(out_bufs);
+  free(out);
+  free(corr);
+  free(din);
+  free(dout);
   pthread_exit(NULL);
 }
 
@@ -1375,8 +5300,19 @@ void TrainModel() {
   starting_alpha = alpha;
   
   // Either load a pre-existing vocabulary, or learn the vocabulary from 
-  // the training file.
-  if (read_vocab_file[0] != 0) ReadVocab(); else LearnVocabFromTrainFile();
+  // the training file. When resuming, it comes from the checkpoint.
+  //
+  // With '-init-model', every word of the new data is counted, and
+  // MergeModelVocab applies 'min_count' once the model's words are merged in.
+  if (resume_file[0] != 0) ResumeVocab();
+  else {
+    int keep_min_count = min_count;
+    if (init_model_file[0] != 0) min_count = 1;
+    if (read_vocab_file[0] != 0) ReadVocab(); else LearnVocabFromTrainFile();
+    min_count = keep_min_count;
+    count_words = train_words;
+    if (init_model_file[0] != 0) MergeModelVocab();
+  }
   
   // Save the vocabulary.
   if (save_vocab_file[0] != 0) SaveVocab();
@@ -1384,28 +5320,138 @@ void TrainModel() {
   // Stop here if no output_file was specified.
   if (output_file[0] == 0) return;
   
-  // Allocate the weight matrices and initialize them.
+  // Convert the training text to vocab ids (or reuse an earlier conversion).
+  if (ids_file[0] != 0) InitIdsCorpus();
+  
+  // gzip data with fewer members than threads can't be split into enough
+  // chunks to keep the threads busy, so it is streamed instead (see
+  // "Compressed Input"). Checkpoints and workers need the chunks, so they
+  // need the data converted with '-ids', or compressed in more members.
+  if ((train_format == READER_GZIP) && (corpus_ids == NULL) &&
+      (gz_index_size < num_threads * (workers > 0 ? workers : 1))) {
+    if ((checkpoint_file[0] != 0) || (resume_file[0] != 0) || (workers > 0)) {
+      printf("ERROR: %s has %lld gzip members, too few to split between the threads\n", train_file, gz_index_size);
+      printf("-checkpoint, -resume and -workers need it converted with -ids, or recompressed with bgzip\n");
+      exit(1);
+    }
+    if (debug_mode > 0) printf("gzip members: %lld; streaming the training data\n", gz_index_size);
+    stream = 2;
+  }
+  
+  // Find the NUMA nodes, then allocate the weight matrices and initialize
+  // them.
+  if (numa) InitNuma();
   InitNet();
+  if ((init_model_file[0] != 0) && (resume_file[0] == 0)) LoadModelWeights();
 
   // If we're using negative sampling, initialize the unigram table, which
   // is used to pick words to use as "negative samples" (with more frequent
   // words being picked more often).  
-  if (negative > 0) InitUnigramTable();
+  // The alias table does the same job in a fraction of the memory.
+  if (negative > 0) {
+    if (alias) InitAliasTable(); else InitUnigramTable();
+  }
+  if (hugepages && (debug_mode > 0)) ReportHugePages();
+  
+  // Pick the SIMD kernels for the training loops.
+  InitVecKernels();
+  if (debug_mode > 0) printf("Vector kernels: %s\n", vec_kernel_name);
+  
+  // With '-workers', fork the worker processes, which do the training below
+  // while this process coordinates them.
+  int coordinator = (workers > 0);
+  if (workers > 0) {
+    StartWorkers();
+    coordinator = (worker_id < 0);
+  }
+  
+  // Split the training data into chunks for the threads.
+  InitWorkChunks();
+  if (hot_words > vocab_size) hot_words = vocab_size;
+  
+  // Each thread's state for checkpoints, which is also where it starts from
+  // when resuming.
+  thread_states = (struct thread_state *)calloc(num_threads, sizeof(struct thread_state));
+  if (resume_file[0] != 0) ResumeTraining();
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&checkpoint_cond, &attr);
+  threads_running = num_threads;
   
   // Record the start time of training.
   start = clock();
+  train_start_time = WallTime();
   
   // Run training, which occurs in the 'TrainModelThread' function.
-  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
-  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  if (!coordinator) {
+    if (stream) StartStream();
+    for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
+    if (checkpoint_file[0] != 0) WaitForTraining();
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    if (stream) pthread_join(stream_reader, NULL);
+  } else FinishWorkers();
+  
+  // Fold the last changes to the replicas into syn1neg.
+  if ((numa > 1) && (negative > 0)) MergeReplicas(0, vocab_size);
+  
+  // A worker sends the rest of its changes to the master copy.
+  if (worker_id >= 0) SyncWorkerRows(0, vocab_size);
+  
+  // Save the whole model, for a later run's '-init-model'.
+  if ((save_model_file[0] != 0) && (worker_id < 0) && WriteCheckpoint(save_model_file)) printf("ERROR: writing %s failed\n", save_model_file);
+  
+  // The word vectors are saved as floats, so convert them back from bf16.
+  if (bf16) {
+    syn0 = (real *)malloc((long long)vocab_size * layer1_size * sizeof(real));
+    if (syn0 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    Bf16ToFloat(syn0, syn0_bf16, (long long)vocab_size * layer1_size);
+  }
+  
+  // Report how the work was spread across the threads. A thread is idle from
+  // the time it runs out of chunks until the last thread finishes.
+  if (debug_mode > 0) {
+    double total = WallTime() - train_start_time;
+    printf("\nTraining time: %.2fs  Words/sec: %.2fk\n", total, WordCountActual() / total / 1000);
+    if (!coordinator) for (a = 0; a < num_threads; a++)
+      printf("Thread %ld: busy %.2fs  idle %.2fs  chunks %lld (%lld stolen)\n", a, thread_stats[a].busy,
+             total - thread_stats[a].busy, thread_stats[a].chunks, thread_stats[a].stolen);
+    
+    // Throughput of each node's group of threads.
+    if (numa && !coordinator) for (b = 0; b < num_numa_nodes; b++) {
+      long long words = 0;
+      double busy = 0;
+      for (a = 0, c = 0; a < num_threads; a++) if (ThreadNode(a) == b) {
+        words += thread_stats[a].words;
+        if (thread_stats[a].busy > busy) busy = thread_stats[a].busy;
+        c++;
+      }
+      printf("Node %ld: %ld threads  %.2fk words/sec\n", b, c, words / (busy + 1e-9) / 1000);
+    }
+    
+    // How many writes to the shared syn0 and syn1neg rows the hot rows
+    // saved. Without them, every row update would be a shared write.
+    if ((hot_words > 0) && !coordinator) {
+      long long updates = 0, hot = 0, merged = 0;
+      for (a = 0; a < num_threads; a++) {
+        updates += thread_stats[a].row_updates;
+        hot += thread_stats[a].hot_updates;
+        merged += thread_stats[a].merge_writes;
+      }
+      printf("Row updates: %lld  hot: %lld  merge writes: %lld  shared writes: %lld (%.1f%% fewer)\n", updates,
+             hot, merged, updates - hot + merged, 100.0 * (hot - merged) / (updates + 1e-9));
+    }
+  }
   
+  // The coordinator saves the results.
+  if (worker_id >= 0) exit(0);
   
   fo = fopen(output_file, "wb");
   if (classes == 0) {
     // Save the word vectors
     fprintf(fo, "%lld %lld\n", vocab_size, layer1_size);
     for (a = 0; a < vocab_size; a++) {
-      fprintf(fo, "%s ", vocab[a].word);
+      fprintf(fo, "%s ", VocabWord(a));
       if (binary) for (b = 0; b < layer1_size; b++) fwrite(&syn0[a * layer1_size + b], sizeof(real), 1, fo);
       else for (b = 0; b < layer1_size; b++) fprintf(fo, "%lf ", syn0[a * layer1_size + b]);
       fprintf(fo, "\n");
@@ -1449,7 +5495,7 @@ void TrainModel() {
       }
     }
     // Save the K-means classes
-    for (a = 0; a < vocab_size; a++) fprintf(fo, "%s %d\n", vocab[a].word, cl[a]);
+    for (a = 0; a < vocab_size; a++) fprintf(fo, "%s %d\n", VocabWord(a), cl[a]);
     free(centcn);
     free(cent);
     free(cl);
@@ -1476,7 +5522,8 @@ int main(int argc, char **argv) {
     printf("Options:\n");
     printf("Parameters for training:\n");
     printf("\t-train <file>\n");
-    printf("\t\tUse text data from <file> to train the model\n");
+    printf("\t\tUse text data from <file> to train the model; '-' or a named pipe is streamed in a single pass,\n");
+    printf("\t\twhich needs -read-vocab. gzip and zstd files are decompressed as they are read\n");
     printf("\t-output <file>\n");
     printf("\t\tUse <file> to save the resulting word vectors / word clusters\n");
     printf("\t-size <int>\n");
@@ -1488,14 +5535,56 @@ int main(int argc, char **argv) {
     printf("\t\twill be randomly down-sampled; default is 1e-3, useful range is (0, 1e-5)\n");
     printf("\t-hs <int>\n");
     printf("\t\tUse Hierarchical Softmax; default is 0 (not used)\n");
+    printf("\t-hs-private <int>\n");
+    printf("\t\tGive each thread its own copy of the top <int> levels of the Huffman tree, merged into the shared\n");
+    printf("\t\tweights periodically; default is 0 (off)\n");
+    printf("\t-hs-private-sync <int>\n");
+    printf("\t\tMerge the private copies every <int> words per thread; default is 1000\n");
+    printf("\t-hot-words <int>\n");
+    printf("\t\tGive each thread its own copy of the syn0 and syn1neg rows of the <int> most frequent words,\n");
+    printf("\t\tmerged into the shared weights periodically; default is 0 (off)\n");
+    printf("\t-hot-sync <int>\n");
+    printf("\t\tMerge the hot rows every <int> words per thread; default is 2000\n");
     printf("\t-negative <int>\n");
     printf("\t\tNumber of negative examples; default is 5, common values are 3 - 10 (0 = not used)\n");
+    printf("\t-shared-negative <int>\n");
+    printf("\t\tShare one set of negative examples across each skip-gram window and train the window with\n");
+    printf("\t\tsmall matrix products; default is 0 (off)\n");
+    printf("\t-alias <int>\n");
+    printf("\t\tDraw negative examples with an alias table instead of the 400MB unigram table; default is 0 (off)\n");
     printf("\t-threads <int>\n");
     printf("\t\tUse <int> threads (default 12)\n");
+    printf("\t-workers <int>\n");
+    printf("\t\tTrain in <int> worker processes, each on its own shard of the data with -threads threads, which\n");
+    printf("\t\tsync their changes through shared memory; default is 0 (train in this process)\n");
+    printf("\t-worker-sync <int>\n");
+    printf("\t\tSync each thread's share of the rows every <int> words; default is 10000\n");
+    printf("\t-numa <int>\n");
+    printf("\t\tPin the threads to NUMA nodes and spread the weights across the nodes (1), and also keep a copy\n");
+    printf("\t\tof the output weights on each node (2); default is 0 (off)\n");
+    printf("\t-numa-sync <int>\n");
+    printf("\t\tWith -numa 2, merge the output weight copies every <int> words per thread; default is 1000000\n");
+    printf("\t-bf16 <int>\n");
+    printf("\t\tStore the word vectors and negative sampling weights in bfloat16, halving their memory; the math\n");
+    printf("\t\tis still done in fp32, and the vectors are saved as floats; default is 0 (off)\n");
+    printf("\t-hugepages <int>\n");
+    printf("\t\tBack the weight matrices with transparent 2MB pages (1), or with explicit huge pages, falling back\n");
+    printf("\t\tto transparent ones (2); default is 0 (off)\n");
+    printf("\t-seed <int>\n");
+    printf("\t\tSeed for the random number generators; runs with the same seed and thread count draw the same\n");
+    printf("\t\trandom numbers; default is 1\n");
     printf("\t-iter <int>\n");
     printf("\t\tRun more training iterations (default 5)\n");
     printf("\t-min-count <int>\n");
     printf("\t\tThis will discard words that appear less than <int> times; default is 5\n");
+    printf("\t-vocab-memory <int>\n");
+    printf("\t\tCount the vocabulary exactly in about <int> MB of memory, writing partial counts to temporary\n");
+    printf("\t\tfiles when they don't fit; default is 0 (no limit)\n");
+    printf("\t-spill-dir <dir>\n");
+    printf("\t\tWrite the temporary files of -vocab-memory to <dir>; default is $TMPDIR, or /tmp\n");
+    printf("\t-approx-vocab <int>\n");
+    printf("\t\tBuild the vocabulary in fixed memory, from the <int> words estimated to be most frequent, counted\n");
+    printf("\t\texactly in a second pass over the data; default is 0 (off)\n");
     printf("\t-alpha <float>\n");
     printf("\t\tSet the starting learning rate; default is 0.025 for skip-gram and 0.05 for CBOW\n");
     printf("\t-classes <int>\n");
@@ -1508,6 +5597,20 @@ int main(int argc, char **argv) {
     printf("\t\tThe vocabulary will be saved to <file>\n");
     printf("\t-read-vocab <file>\n");
     printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
+    printf("\t-ids <file>\n");
+    printf("\t\tTrain from a pre-tokenized copy of the training data stored in <file>; it is written on the first run\n");
+    printf("\t\tand reused by later runs with the same vocabulary\n");
+    printf("\t-checkpoint <file>\n");
+    printf("\t\tPeriodically save the training state to <file>, so that the run can be resumed\n");
+    printf("\t-checkpoint-interval <int>\n");
+    printf("\t\tSave a checkpoint every <int> seconds; default is 1800\n");
+    printf("\t-resume <file>\n");
+    printf("\t\tContinue training from the checkpoint in <file>; the other options must match the original run\n");
+    printf("\t-save-model <file>\n");
+    printf("\t\tSave the whole model (vocabulary, counts and weights) to <file> for later use with -init-model\n");
+    printf("\t-init-model <file>\n");
+    printf("\t\tContinue training the model saved in <file> (by -save-model or -checkpoint) on new data; new\n");
+    printf("\t\twords from the training data are added to its vocabulary\n");
     printf("\t-cbow <int>\n");
     printf("\t\tUse the continuous bag of words model; default is 1 (use 0 for skip-gram model)\n");
     printf("\nExamples:\n");
@@ -1517,10 +5620,17 @@ int main(int argc, char **argv) {
   output_file[0] = 0;
   save_vocab_file[0] = 0;
   read_vocab_file[0] = 0;
+  ids_file[0] = 0;
   if ((i = ArgPos((char *)"-size", argc, argv)) > 0) layer1_size = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-save-vocab", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-read-vocab", argc, argv)) > 0) strcpy(read_vocab_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-ids", argc, argv)) > 0) strcpy(ids_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-checkpoint", argc, argv)) > 0) strcpy(checkpoint_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-checkpoint-interval", argc, argv)) > 0) checkpoint_interval = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-resume", argc, argv)) > 0) strcpy(resume_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-save-model", argc, argv)) > 0) strcpy(save_model_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-init-model", argc, argv)) > 0) strcpy(init_model_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-cbow", argc, argv)) > 0) cbow = atoi(argv[i + 1]);
@@ -1530,17 +5640,88 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-window", argc, argv)) > 0) window = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-hs", argc, argv)) > 0) hs = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hs-private", argc, argv)) > 0) hs_private_levels = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hs-private-sync", argc, argv)) > 0) hs_private_sync = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hot-words", argc, argv)) > 0) hot_words = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hot-sync", argc, argv)) > 0) hot_sync = atoll(argv[i + 1]);
   if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-shared-negative", argc, argv)) > 0) shared_negative = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-alias", argc, argv)) > 0) alias = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-numa", argc, argv)) > 0) numa = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-numa-sync", argc, argv)) > 0) numa_sync = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-bf16", argc, argv)) > 0) bf16 = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-workers", argc, argv)) > 0) workers = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-worker-sync", argc, argv)) > 0) worker_sync = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hugepages", argc, argv)) > 0) hugepages = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-seed", argc, argv)) > 0) seed = strtoull(argv[i + 1], NULL, 10);
   if ((i = ArgPos((char *)"-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-approx-vocab", argc, argv)) > 0) approx_vocab = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-vocab-memory", argc, argv)) > 0) vocab_memory = atoll(argv[i + 1]) << 20;
+  snprintf(spill_dir, MAX_STRING, "%s", (getenv("TMPDIR") != NULL) ? getenv("TMPDIR") : "/tmp");
+  if ((i = ArgPos((char *)"-spill-dir", argc, argv)) > 0) strcpy(spill_dir, argv[i + 1]);
+  if ((approx_vocab > 0) && (vocab_memory > 0)) {
+    printf("ERROR: -approx-vocab and -vocab-memory can't be used together\n");
+    exit(1);
+  }
+  if (approx_vocab > vocab_size_limit / 2) approx_vocab = vocab_size_limit / 2;
   if ((i = ArgPos((char *)"-classes", argc, argv)) > 0) classes = atoi(argv[i + 1]);
+  // The NUMA replicas of syn1neg are kept in fp32 only.
+  if (bf16 && (numa > 1)) {
+    printf("-bf16 does not support -numa 2; using -numa 1\n");
+    numa = 1;
+  }
+  
+  // Training data which can't be read twice, from stdin or a named pipe, is
+  // streamed in a single pass, with the vocabulary from '-read-vocab'.
+  struct stat st;
+  if (!strcmp(train_file, "-") || ((stat(train_file, &st) == 0) && S_ISFIFO(st.st_mode))) {
+    stream = 1;
+    if (read_vocab_file[0] == 0) {
+      printf("ERROR: training from stdin or a pipe needs -read-vocab\n");
+      exit(1);
+    }
+    if ((ids_file[0] != 0) || (checkpoint_file[0] != 0) || (resume_file[0] != 0) || (workers > 0)) {
+      printf("ERROR: -ids, -checkpoint, -resume and -workers need a regular training file\n");
+      exit(1);
+    }
+    if (iter != 1) printf("Training from a stream: using -iter 1\n");
+    iter = 1;
+  }
+  
+  // Compressed training data is decompressed as it is read (see "Compressed
+  // Input"). zstd data can't be split into chunks, so unless it is converted
+  // with '-ids', it is streamed, and read again for each iteration.
+  train_format = stream ? READER_TEXT : ReaderFormat(train_file);
+  if ((train_format == READER_ZSTD) && (ids_file[0] == 0)) {
+    stream = 2;
+    if ((checkpoint_file[0] != 0) || (resume_file[0] != 0) || (workers > 0)) {
+      printf("ERROR: -checkpoint, -resume and -workers need zstd training data to be converted with -ids\n");
+      exit(1);
+    }
+  }
+  
+  // The workers sync fp32 weights, and the coordinator has no training state
+  // to checkpoint.
+  if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+  if (workers > 0) {
+    if (bf16) printf("-workers does not support -bf16; using fp32\n");
+    if (numa > 1) printf("-workers does not support -numa 2; using -numa 1\n");
+    if ((checkpoint_file[0] != 0) || (resume_file[0] != 0)) {
+      printf("ERROR: -checkpoint and -resume do not support -workers\n");
+      exit(1);
+    }
+    bf16 = 0;
+    if (numa > 1) numa = 1;
+  }
   
   // Allocate the vocabulary table.
-  vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
+  vocab_cn = (long long *)calloc(vocab_max_size, sizeof(long long));
+  vocab_str = (long long *)calloc(vocab_max_size, sizeof(long long));
   
   // Allocate the hash table for mapping word strings to word entries.
-  vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
+  InitVocabHash(0);
    
   /*
    * ======== Precomputed Exp Table ========